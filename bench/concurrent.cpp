@@ -0,0 +1,115 @@
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include <fmt/format.h>
+
+#include "include/hash.hpp"
+
+// Contention on a concurrent expression table: for 1 up to as
+// many workers as there are hardware threads, every worker pushes
+// the same corpus (in its own order) through its own arena; then
+// checks that each expression was stored once, and that every
+// push of it returned the same index
+//
+// Usage: bench_concurrent [corpus size]
+
+static Expression _expression(size_t i, const Symbol &x, scoped_memory_manager &smm)
+{
+	ETN_ref a = smm.make(_expr_tree_atom(Integer(i)));
+	ETN_ref b = smm.make(_expr_tree_atom(x));
+	a->next() = b;
+
+	ETN_ref etn = smm.make(_expr_tree_op {
+		.op = add,
+		.dom = real,
+		.down = a,
+		.next = nullptr
+	});
+
+	return { etn, Signature_ref() };
+}
+
+// Pushes by each worker, with the index returned for each
+// expression and the number of novel pushes; returns the
+// number of errors found
+static size_t _run(size_t workers, size_t n, const Symbol &x)
+{
+	ConcurrentExpressionTable table(2 * n, workers);
+
+	std::vector <std::vector <size_t>> indices(workers, std::vector <size_t> (n));
+	std::vector <size_t> novel(workers);
+	std::vector <size_t> full(workers);
+
+	auto start = std::chrono::steady_clock::now();
+
+	std::vector <std::thread> threads;
+	for (size_t t = 0; t < workers; t++) {
+		threads.emplace_back([&, t]() {
+			scoped_memory_manager &smm = table.arena(t);
+			for (size_t k = 0; k < n; k++) {
+				size_t i = (k + t * n / workers) % n;
+
+				auto result = table.push(_expression(i, x, smm));
+				if (!result) {
+					full[t]++;
+					continue;
+				}
+
+				indices[t][i] = result->index;
+				novel[t] += result->novel;
+			}
+		});
+	}
+
+	for (std::thread &thread : threads)
+		thread.join();
+
+	std::chrono::duration <double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+	size_t errors = 0;
+	for (size_t t = 0; t < workers; t++)
+		errors += full[t];
+
+	size_t stored = 0;
+	for (size_t t = 0; t < workers; t++)
+		stored += novel[t];
+
+	if (table.unique != n || stored != n)
+		errors++;
+
+	// Every worker (and a push after the fact) must
+	// agree on the index of every expression
+	for (size_t i = 0; i < n; i++) {
+		auto result = table.push(_expression(i, x, table.arena(0)));
+		if (!result || result->novel)
+			errors++;
+
+		for (size_t t = 0; t < workers; t++) {
+			if (!result || indices[t][i] != result->index)
+				errors++;
+		}
+	}
+
+	fmt::println("  {:2} workers: {} unique, {} pushes in {:.1f}ms, {:.1f}ns per push, {} errors",
+		workers, table.unique.load(), workers * n, elapsed.count(),
+		elapsed.count() * 1e6 / (workers * n), errors);
+
+	return errors;
+}
+
+int main(int argc, char **argv)
+{
+	size_t n = argc > 1 ? std::stoul(argv[1]) : 200000;
+	size_t workers = std::max(std::thread::hardware_concurrency(), 1u);
+
+	Symbol x = "x";
+
+	fmt::println("{} expressions:", n);
+
+	size_t errors = 0;
+	for (size_t t = 1; t <= workers; t++)
+		errors += _run(t, n, x);
+
+	return errors > 0;
+}
@@ -0,0 +1,462 @@
+#include <bit>
+#include <bitset>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <set>
+#include <unordered_map>
+
+#include <fmt/format.h>
+
+#include "include/format.hpp"
+#include "include/hash.hpp"
+#include "include/linear.hpp"
+
+// Hash quality over corpora of distinct expressions: collision
+// rates, bucket distribution in an expression table, avalanche
+// and throughput, for the hash selected with OXIDIUS_HASH; and
+// pushes into an expression table against the fixed table of
+// buckets with validity bits that it replaced
+//
+// Usage: bench_hash [corpus size]
+
+using _corpus = std::vector <ETN_ref>;
+
+static std::mt19937_64 rng(42);
+
+static ETN_ref _random_tree(int depth, const std::vector <Symbol> &symbols, scoped_memory_manager &smm)
+{
+	if (depth == 0 || rng() % 3 == 0) {
+		switch (rng() % 3) {
+		case 0:
+			return smm.make(_expr_tree_atom(symbols[rng() % symbols.size()]));
+		case 1:
+			return smm.make(_expr_tree_atom(Integer(rng() % 100)));
+		default:
+			return smm.make(_expr_tree_atom(InternedReal(Real(rng() % 50) / 4)));
+		}
+	}
+
+	static constexpr Operation ops[] { add, subtract, multiply, divide };
+
+	ETN_ref lhs = _random_tree(depth - 1, symbols, smm);
+	lhs->next() = _random_tree(depth - 1, symbols, smm);
+
+	return smm.make(_expr_tree_op {
+		.op = ops[rng() % 4],
+		.dom = real,
+		.down = lhs,
+		.next = nullptr
+	});
+}
+
+// Distinct by printed form, so that deduplication
+// does not depend on the hash under test
+static _corpus _random_corpus(size_t n, scoped_memory_manager &smm)
+{
+	std::vector <Symbol> symbols;
+	for (const char *s : { "a", "b", "c", "d", "e", "f", "g", "h" })
+		symbols.emplace_back(s);
+
+	_corpus corpus;
+	std::set <std::string> seen;
+	while (corpus.size() < n) {
+		ETN_ref etn = _random_tree(1 + rng() % 5, symbols, smm);
+		if (seen.insert(format_as(Expression { etn, Signature_ref() })).second)
+			corpus.push_back(etn);
+	}
+
+	return corpus;
+}
+
+// Every form of a binary tree under commutativity of add and
+// multiply, i.e. what exhaustive rewriting by either reaches
+static void _commuted(const ETN_ref &etn, _corpus &out, scoped_memory_manager &smm)
+{
+	if (etn->is <_expr_tree_atom> ()) {
+		out.push_back(smm.make(etn->as <_expr_tree_atom> ()));
+		return;
+	}
+
+	const auto &tree = etn->as <_expr_tree_op> ();
+
+	_corpus lhs;
+	_corpus rhs;
+	_commuted(tree.down, lhs, smm);
+	_commuted(tree.down->next(), rhs, smm);
+
+	for (const ETN_ref &l : lhs) {
+		for (const ETN_ref &r : rhs) {
+			for (int swap = 0; swap < 1 + is_ac(tree.op); swap++) {
+				ETN_ref first = clone_soft(swap ? r : l, smm);
+				ETN_ref second = clone_soft(swap ? l : r, smm);
+				first->next() = second;
+				second->next() = nullptr;
+
+				out.push_back(smm.make(_expr_tree_op {
+					.op = tree.op,
+					.dom = tree.dom,
+					.down = first,
+					.next = nullptr
+				}));
+			}
+		}
+	}
+}
+
+static _corpus _rewrite_corpus(scoped_memory_manager &smm)
+{
+	static const char *seeds[] {
+		"a + (b + (c + (d + (e + (f + g)))))",
+		"(a + b) * (c + d) + (e + f) * (g + 1)",
+		"1 + (2 + (3 + (4 + (5 + (6 + x)))))",
+		"a * (b * (c * (d * (e * (f * g)))))",
+	};
+
+	_corpus corpus;
+	for (const char *seed : seeds)
+		_commuted(Expression::from(seed).value().etn, corpus, smm);
+
+	return corpus;
+}
+
+// Structural hash used before hashes were kept in node
+// metadata: two shallow hashes, rotated and ORed, with
+// numbers hashed to 0
+template <size_t N>
+static hash_type _legacy_hhash(const ETN_ref &etn)
+{
+	if (etn->is <_expr_tree_atom> ()) {
+		const Atom &atom = etn->as <_expr_tree_atom> ().atom;
+		if (N > 0 || !atom.is <Symbol> ())
+			return 0;
+
+		return atom.as <Symbol> ().id;
+	}
+
+	const auto &tree = etn->as <_expr_tree_op> ();
+
+	int64_t seed = tree.op;
+	if constexpr (N > 0) {
+		for (ETN_ref head = tree.down; head; head = head->next()) {
+			seed++;
+			seed ^= _legacy_hhash <N - 1> (head);
+		}
+	}
+
+	return seed;
+}
+
+static hash_type _legacy_hash(const ETN_ref &etn)
+{
+	hash_type h0 = _legacy_hhash <0> (etn);
+	hash_type h1 = _legacy_hhash <1> (etn);
+	hash_type h2 = _legacy_hhash <2> (etn);
+	return std::rotr(h1, h0 % 7) | std::rotl(h2, h0 % 11);
+}
+
+static hash_type _merkle_hash(const ETN_ref &etn)
+{
+	return quick_hash(etn);
+}
+
+// Collisions, and the spread over the home groups of a control
+// byte index with 4096 groups (i.e. how an expression table
+// places them), as a chi-squared statistic per degree of freedom
+static void _report(const char *name, const _corpus &corpus, hash_type (*hash)(const ETN_ref &))
+{
+	static constexpr size_t groups = 4096;
+
+	std::unordered_map <hash_type, size_t> full;
+	std::unordered_map <uint32_t, size_t> low;
+	std::vector <size_t> buckets(groups);
+
+	for (const ETN_ref &etn : corpus) {
+		hash_type h = hash(etn);
+		full[h]++;
+		low[uint32_t(h)]++;
+		buckets[_control_index::home(h) & (groups - 1)]++;
+	}
+
+	double n = corpus.size();
+	double expected = n / groups;
+
+	double chi = 0;
+	for (size_t b : buckets)
+		chi += (b - expected) * (b - expected) / expected;
+
+	fmt::println("  {:8} distinct 64-bit {:6.2f}%, 32-bit {:6.2f}%, group chi2/dof {:8.2f}, largest group {} (mean {:.1f})",
+		name, 100 * full.size() / n, 100 * low.size() / n, chi / (groups - 1),
+		*std::max_element(buckets.begin(), buckets.end()), expected);
+}
+
+// Probing as seen by the table itself
+static void _report_table(const _corpus &corpus)
+{
+	ExpressionTable table;
+	for (const ETN_ref &etn : corpus)
+		table.push({ etn, Signature_ref() });
+
+	const table_stats &stats = table.stats;
+	fmt::println("  table    {} entries, {:.3f} groups probed per lookup, {} at most",
+		table.size(), double(stats.probes) / stats.lookups, stats.max_probe);
+}
+
+// Copy of a tree with one integer leaf incremented
+static ETN_ref _bumped(const ETN_ref &etn, const ETN_ref &leaf, scoped_memory_manager &smm)
+{
+	if (etn->is <_expr_tree_atom> ()) {
+		Atom atom = etn->as <_expr_tree_atom> ().atom;
+		if (etn == leaf)
+			atom = Integer(atom.as <Integer> () + 1);
+
+		return smm.make(_expr_tree_atom(atom));
+	}
+
+	_corpus operands;
+	etn->forall_operands([&](const ETN_ref &head) {
+		operands.push_back(_bumped(head, leaf, smm));
+	});
+
+	for (size_t i = 0; i + 1 < operands.size(); i++)
+		operands[i]->next() = operands[i + 1];
+
+	const auto &tree = etn->as <_expr_tree_op> ();
+	return smm.make(_expr_tree_op {
+		.op = tree.op,
+		.dom = tree.dom,
+		.down = operands.front(),
+		.next = nullptr
+	});
+}
+
+static ETN_ref _integer_leaf(const ETN_ref &etn)
+{
+	if (etn->is <_expr_tree_atom> ())
+		return etn->as <_expr_tree_atom> ().atom.is <Integer> () ? etn : nullptr;
+
+	ETN_ref found = nullptr;
+	etn->forall_operands([&](const ETN_ref &head) {
+		if (!found)
+			found = _integer_leaf(head);
+	});
+
+	return found;
+}
+
+// Bits flipped by a one-unit change of a leaf; ideally
+// half of them (32) with a standard deviation of 4
+static void _report_avalanche(const _corpus &corpus)
+{
+	scoped_memory_manager smm;
+
+	double sum = 0;
+	double squares = 0;
+	size_t samples = 0;
+
+	for (const ETN_ref &etn : corpus) {
+		ETN_ref leaf = _integer_leaf(etn);
+		if (!leaf)
+			continue;
+
+		int flips = std::popcount(etn->meta.hash ^ _bumped(etn, leaf, smm)->meta.hash);
+		sum += flips;
+		squares += flips * flips;
+		samples++;
+	}
+
+	double mean = sum / samples;
+	fmt::println("  avalanche over {} samples: {:.2f} bits flipped (ideal 32), stddev {:.2f} (ideal 4)",
+		samples, mean, std::sqrt(squares / samples - mean * mean));
+}
+
+// Tree hashes are cached in the nodes, so throughput
+// is measured on the linearized form
+static void _report_throughput(const _corpus &corpus)
+{
+	std::vector <LinearExpression> linear;
+
+	size_t nodes = 0;
+	for (const ETN_ref &etn : corpus) {
+		linear.push_back(LinearExpression::from(etn));
+		nodes += etn->meta.size;
+	}
+
+	static constexpr int rounds = 5;
+
+	volatile hash_type sink = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (int r = 0; r < rounds; r++) {
+		for (const LinearExpression &lexpr : linear)
+			sink = sink + quick_hash(lexpr);
+	}
+
+	double seconds = std::chrono::duration <double> (std::chrono::steady_clock::now() - start).count();
+	fmt::println("  throughput: {:.2f}M expressions/s, {:.1f}M nodes/s",
+		rounds * linear.size() / seconds / 1e6, rounds * nodes / seconds / 1e6);
+}
+
+// Fixed table of M buckets of N slots, as expression tables
+// were before they could grow; a push into a full bucket is
+// silently dropped, though duplicates are no longer novel
+template <size_t M, size_t N>
+struct _bitset_table {
+	std::bitset <M * N> valid;
+	Expression data[M][N];
+	size_t unique = 0;
+
+	// True if the expression is novel; the slot
+	// taken is recorded in the marker, if any
+	bool push(const Expression &expr, std::vector <size_t> *marker = nullptr) {
+		size_t h = quick_hash(expr) % M;
+		for (size_t i = 0; i < N; i++) {
+			size_t j = h * N + i;
+			if (!valid[j]) {
+				data[h][i] = expr;
+				valid[j] = true;
+				unique++;
+				if (marker)
+					marker->push_back(j);
+
+				return true;
+			}
+
+			if (equal(data[h][i], expr))
+				return false;
+		}
+
+		return false;
+	}
+
+	void clear(const std::vector <size_t> &marker) {
+		for (size_t j : marker) {
+			unique -= valid[j];
+			valid[j] = false;
+		}
+	}
+};
+
+// Best time per operation over a few runs, in nanoseconds
+template <typename F>
+static double _time(size_t operations, F &&f)
+{
+	double best = std::numeric_limits <double>::infinity();
+	for (int r = 0; r < 7; r++) {
+		auto start = std::chrono::steady_clock::now();
+		f();
+		std::chrono::duration <double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+		best = std::min(best, elapsed.count() / operations);
+	}
+
+	return best;
+}
+
+// Pushes of expressions already present (hits), and of new
+// ones that are then undone (misses), after preloading n
+// expressions; the bitset table only keeps up while it is
+// small enough to hold them all
+static void _report_tables(scoped_memory_manager &smm)
+{
+	static constexpr size_t rounds = 10;
+
+	Symbol x = "x";
+
+	std::vector <Expression> exprs;
+	for (int i = 0; i < 20000; i++) {
+		ETN_ref a = smm.make(_expr_tree_atom(Integer(i % 100)));
+		ETN_ref b = smm.make(_expr_tree_atom(x));
+		ETN_ref c = smm.make(_expr_tree_atom(Integer(i / 100)));
+		a->next() = b;
+		b->next() = c;
+
+		ETN_ref etn = smm.make(_expr_tree_op {
+			.op = (i & 1) ? add : multiply,
+			.dom = real,
+			.down = a,
+			.next = nullptr
+		});
+
+		exprs.push_back({ etn, Signature_ref() });
+	}
+
+	for (size_t n : { 100, 1000, 10000 }) {
+		volatile size_t sink = 0;
+
+		auto bitset = std::make_unique <_bitset_table <41, 4>> ();
+		for (size_t i = 0; i < n; i++)
+			bitset->push(exprs[i]);
+
+		double bitset_hit = _time(rounds * n, [&]() {
+			for (size_t r = 0; r < rounds; r++) {
+				for (size_t i = 0; i < n; i++)
+					sink = sink + bitset->push(exprs[i]);
+			}
+		});
+
+		double bitset_miss = _time(rounds * n, [&]() {
+			std::vector <size_t> marker;
+			for (size_t r = 0; r < rounds; r++) {
+				for (size_t i = n; i < 2 * n; i++) {
+					marker.clear();
+					sink = sink + bitset->push(exprs[i], &marker);
+					bitset->clear(marker);
+				}
+			}
+		});
+
+		ExpressionTable table;
+		for (size_t i = 0; i < n; i++)
+			table.push(exprs[i]);
+
+		double table_hit = _time(rounds * n, [&]() {
+			for (size_t r = 0; r < rounds; r++) {
+				for (size_t i = 0; i < n; i++)
+					sink = sink + table.push(exprs[i]);
+			}
+		});
+
+		double table_miss = _time(rounds * n, [&]() {
+			for (size_t r = 0; r < rounds; r++) {
+				for (size_t i = n; i < 2 * n; i++) {
+					table_epoch epoch = table.checkpoint();
+					sink = sink + table.push(exprs[i]);
+					table.rollback(epoch);
+				}
+			}
+		});
+
+		fmt::println("  n = {:5}: bitset keeps {:5}, hit {:6.1f}ns, miss + clear {:6.1f}ns;"
+			" table keeps {:5}, hit {:6.1f}ns, miss + rollback {:6.1f}ns",
+			n, bitset->unique, bitset_hit, bitset_miss,
+			table.size(), table_hit, table_miss);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	size_t n = argc > 1 ? std::stoul(argv[1]) : 200000;
+
+	scoped_memory_manager smm;
+
+	fmt::println("OXIDIUS_HASH={}, OXIDIUS_HASH_SEED={}", OXIDIUS_HASH, OXIDIUS_HASH_SEED);
+
+	_corpus random = _random_corpus(n, smm);
+	fmt::println("random corpus: {} distinct expressions", random.size());
+	_report("legacy", random, _legacy_hash);
+	_report("merkle", random, _merkle_hash);
+	_report_table(random);
+
+	_corpus rewritten = _rewrite_corpus(smm);
+	fmt::println("rewrite corpus: {} distinct expressions", rewritten.size());
+	_report("legacy", rewritten, _legacy_hash);
+	_report("merkle", rewritten, _merkle_hash);
+	_report_table(rewritten);
+
+	fmt::println("merkle hash:");
+	_report_avalanche(random);
+	_report_throughput(random);
+
+	fmt::println("tables:");
+	_report_tables(smm);
+}
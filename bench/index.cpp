@@ -0,0 +1,173 @@
+#include <chrono>
+#include <random>
+
+#include <fmt/format.h>
+
+#include "include/index.hpp"
+
+// Retrieving the rules of a library that match a term, and matching
+// a term against all of them at once, with a discrimination tree,
+// against matching it with each rule in turn; over random libraries
+// of rules (patterns rooted at an operation, with repeated variables
+// and small constants) and random terms, checking that all three
+// find the same rules, and the last two the same bindings
+//
+// Usage: bench_index [queries]
+
+static std::mt19937_64 rng(42);
+
+static constexpr Operation ops[] { add, subtract, multiply, divide };
+
+static ETN_ref _random_tree(int depth, const std::vector <Symbol> &symbols, scoped_memory_manager &smm)
+{
+	if (depth == 0 || rng() % 3 == 0) {
+		if (rng() % 4 == 0)
+			return smm.make(_expr_tree_atom(Integer(rng() % 4)));
+
+		return smm.make(_expr_tree_atom(symbols[rng() % symbols.size()]));
+	}
+
+	ETN_ref lhs = _random_tree(depth - 1, symbols, smm);
+	lhs->next() = _random_tree(depth - 1, symbols, smm);
+
+	return smm.make(_expr_tree_op {
+		.op = ops[rng() % 4],
+		.dom = real,
+		.down = lhs,
+		.next = nullptr
+	});
+}
+
+// Rooted at an operation, so that no pattern matches everything;
+// queries are made the same way, only deeper
+static ETN_ref _random_pattern(int depth, const std::vector <Symbol> &symbols, scoped_memory_manager &smm)
+{
+	ETN_ref lhs = _random_tree(depth - 1, symbols, smm);
+	lhs->next() = _random_tree(depth - 1, symbols, smm);
+
+	return smm.make(_expr_tree_op {
+		.op = ops[rng() % 4],
+		.dom = real,
+		.down = lhs,
+		.next = nullptr
+	});
+}
+
+static double _us_since(std::chrono::steady_clock::time_point start)
+{
+	std::chrono::duration <double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+	return elapsed.count();
+}
+
+// Returns the number of queries on which the two disagree
+static size_t _run(size_t n, const std::vector <ETN_ref> &queries, scoped_memory_manager &smm)
+{
+	std::vector <Symbol> variables;
+	for (const char *s : { "a", "b", "c", "d" })
+		variables.emplace_back(s);
+
+	Symbol owner = "library";
+
+	DiscriminationTree tree;
+	for (size_t i = 0; i < n; i++) {
+		Expression from { _random_pattern(3, variables, smm), Signature_ref() };
+		Expression to { _random_tree(2, variables, smm), Signature_ref() };
+		tree.insert(Rule { from, to, owner });
+	}
+
+	std::vector <uint32_t> candidates;
+	size_t retrieved = 0;
+
+	auto start = std::chrono::steady_clock::now();
+	for (const ETN_ref &query : queries) {
+		candidates.clear();
+		tree.retrieve(query, candidates);
+		retrieved += candidates.size();
+	}
+
+	double retrieval = _us_since(start);
+
+	std::vector <RuleMatch> matches;
+	size_t found = 0;
+
+	start = std::chrono::steady_clock::now();
+	for (const ETN_ref &query : queries) {
+		matches.clear();
+		tree.match(query, matches);
+		found += matches.size();
+	}
+
+	double indexed = _us_since(start);
+
+	size_t looped = 0;
+
+	start = std::chrono::steady_clock::now();
+	for (const ETN_ref &query : queries) {
+		for (const Rule &rule : tree.rules) {
+			Substitution sub;
+			looped += match(rule.from.etn, query, sub);
+		}
+	}
+
+	double scanned = _us_since(start);
+
+	// Same rules, in the same order, with the same bindings
+	size_t errors = 0;
+	for (const ETN_ref &query : queries) {
+		matches.clear();
+		tree.match(query, matches);
+
+		candidates.clear();
+		tree.retrieve(query, candidates);
+
+		size_t k = 0;
+		bool agree = true;
+		for (uint32_t id = 0; id < tree.rules.size() && agree; id++) {
+			const Rule &rule = tree.rules[id];
+
+			Substitution sub;
+			if (!match(rule.from.etn, query, sub))
+				continue;
+
+			agree = k < matches.size() && matches[k].rule == id;
+			for (size_t i = 0; agree && i < rule.symbols.size(); i++)
+				agree = matches[k].sub.find(rule.symbols[i]) == sub.find(rule.symbols[i]);
+
+			k++;
+		}
+
+		errors += !agree || k != matches.size() || candidates.size() != matches.size();
+	}
+
+	size_t q = queries.size();
+	fmt::println("  {:6} rules ({:6} nodes): retrieve {:8.2f}us, match {:8.2f}us, each rule {:9.2f}us, {:8.1f} matches, {} errors",
+		n, tree.nodes.size(), retrieval / q, indexed / q, scanned / q, double(found) / q, errors);
+
+	if (found != looped || retrieved != looped)
+		errors++;
+
+	return errors;
+}
+
+int main(int argc, char **argv)
+{
+	size_t q = argc > 1 ? std::stoul(argv[1]) : 1000;
+
+	scoped_memory_manager smm;
+
+	std::vector <Symbol> symbols;
+	for (const char *s : { "x", "y", "z" })
+		symbols.emplace_back(s);
+
+	std::vector <ETN_ref> queries;
+	for (size_t i = 0; i < q; i++)
+		queries.push_back(_random_pattern(5, symbols, smm));
+
+	fmt::println("{} queries:", q);
+
+	size_t errors = 0;
+	for (size_t n : { 1000, 10000, 100000 })
+		errors += _run(n, queries, smm);
+
+	return errors > 0;
+}
@@ -69,7 +69,7 @@ struct Value : _value_base {
 
 // Types of actions
 struct DefineSymbol {
-	std::string identifier;
+	Symbol identifier;
 	UnresolvedValue value;
 };
 
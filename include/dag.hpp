@@ -0,0 +1,67 @@
+#pragma once
+
+#include <unordered_map>
+
+#include "include/formalism.hpp"
+#include "include/memory.hpp"
+
+// Hash-consed node store; structurally identical subtrees are
+// interned into the same immutable node, so that two interned
+// trees are equal if and only if their roots are the same node
+//
+// Interning works on the first-child/next-sibling encoding, i.e.
+// a node is identified by its label (with the domain of operations),
+// its first child and its next sibling; operand lists that share a
+// suffix share their nodes
+struct _node_key {
+	size_t index;
+	Operation op;
+	Domain dom;
+	Atom atom;
+	ETN_ref down;
+	ETN_ref next;
+
+	bool operator==(const _node_key &) const;
+};
+
+struct _node_key_hash {
+	size_t operator()(const _node_key &) const;
+};
+
+struct node_store {
+	std::unordered_map <_node_key, ETN_ref, _node_key_hash> nodes;
+
+	// Interned nodes are never dropped individually
+	scoped_memory_manager smm;
+
+	// Statistics
+	size_t hits = 0;
+	size_t misses = 0;
+
+	node_store() = default;
+
+	// No copies
+	node_store(const node_store &) = delete;
+	node_store &operator=(const node_store &) = delete;
+
+	ETN_ref make(const Atom &, ETN_ref = nullptr);
+	ETN_ref make(Operation, Domain, ETN_ref, ETN_ref = nullptr);
+
+	// Interned copy of a (foreign) tree, ignoring its next sibling
+	ETN_ref intern(const ETN_ref &);
+	Expression intern(const Expression &);
+
+	// Same interned node with a different next sibling,
+	// sharing all of its operands
+	ETN_ref with_next(const ETN_ref &, ETN_ref);
+
+	// Canonical node for the subtree alone
+	ETN_ref head(const ETN_ref &);
+
+	size_t size() const {
+		return nodes.size();
+	}
+};
+
+// Equality of interned trees
+bool equal(node_store &, const ETN_ref &, const ETN_ref &);
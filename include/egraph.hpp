@@ -0,0 +1,108 @@
+#pragma once
+
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+#include "include/formalism.hpp"
+#include "include/memory.hpp"
+
+using EClassId = uint32_t;
+
+// Node of an e-graph: an atom, or an operation whose
+// operands are equivalence classes rather than subterms
+struct ENode {
+	// None for atoms
+	Operation op;
+
+	// Only for operations
+	Domain dom;
+
+	Atom atom;
+	std::vector <EClassId> operands;
+
+	bool operator==(const ENode &) const;
+};
+
+struct _enode_hash {
+	size_t operator()(const ENode &) const;
+};
+
+struct _eclass {
+	std::vector <ENode> nodes;
+
+	// Nodes with the class as an operand, and their classes;
+	// both may be stale until the next rebuild
+	std::vector <std::pair <ENode, EClassId>> parents;
+};
+
+// One direction of a statement; the symbols of the pattern
+// are its variables, by first occurrence (i.e. by slot)
+struct _erule {
+	ETN_ref from;
+	ETN_ref to;
+	std::vector <Symbol> symbols;
+};
+
+// Cost of a node alone, which must be positive; the cost of
+// a term is the sum over its nodes
+using ECost = std::function <double (const ENode &)>;
+
+inline double term_size(const ENode &)
+{
+	return 1;
+}
+
+// Equivalence classes of terms, closed under congruence; each
+// node is stored once, so that a rewrite adds only the nodes of
+// its result that are new and merges it with the class it came
+// from, instead of copying the whole term
+struct EGraph {
+	// Hash-consed nodes, with canonical operands (as of
+	// the last rebuild) and the class of each
+	std::unordered_map <ENode, EClassId, _enode_hash> memo;
+
+	// Union-find over class ids; only roots are canonical,
+	// and only their entries in classes are in use
+	std::vector <EClassId> parent;
+	std::vector <_eclass> classes;
+	size_t live = 0;
+
+	// Roots merged since the last rebuild, whose
+	// parents may no longer be canonical
+	std::vector <EClassId> pending;
+
+	EClassId find(EClassId);
+
+	// Class of a node (or of a whole term), created if needed
+	EClassId add(ENode);
+	EClassId add(const ETN_ref &);
+
+	// Returns the root of the merged class; congruence is
+	// only restored by the next rebuild
+	EClassId merge(EClassId, EClassId);
+
+	void rebuild();
+
+	// Applies both directions of every statement until nothing
+	// changes (true), or until either the iteration or the node
+	// limit is hit (false); rebuilds after each iteration
+	bool saturate(const std::vector <Statement> &, size_t, size_t);
+
+	// Cheapest term of a class
+	ETN_ref extract(EClassId, scoped_memory_manager &, const ECost & = term_size);
+
+	// Number of nodes
+	size_t size() const {
+		return memo.size();
+	}
+private:
+	// Matches of a pattern in a class (up to a limit), with
+	// the class bound to each slot
+	size_t _ematch(const _erule &, EClassId, std::vector <EClassId> &, size_t);
+
+	// Adds the right side of a rule under its slots
+	EClassId _instantiate(const ETN_ref &, const _erule &, const EClassId *);
+
+	ETN_ref _build(EClassId, const std::vector <uint32_t> &, scoped_memory_manager &);
+};
@@ -19,6 +19,12 @@ enum Operation {
 	pbegin, pend
 };
 
+// Associative and commutative operations
+inline bool is_ac(Operation op)
+{
+	return op == add || op == multiply;
+}
+
 struct Comparator {
 	Symbol s;
 
@@ -28,19 +34,46 @@ struct Comparator {
 // A domain signature indicates the types of each *symbol*
 using Signature = std::unordered_map <Symbol, Domain>;
 
-bool add_signature(Signature &, const std::string &, Domain);
+bool add_signature(Signature &, const Symbol &, Domain);
 std::optional <Signature> join(const Signature &, const Signature &);
 
-template <typename E>
-Signature default_signature(const E &e)
-{
-	Signature result;
+// Handle to an interned, immutable signature; equal
+// signatures share a single instance in a global pool
+struct Signature_ref {
+	const Signature *ptr;
 
-	auto symbols = e.symbols();
-	for (const auto &s : symbols)
-		result[s] = real;
+	// Empty signature
+	Signature_ref();
 
-	return result;
+	Signature_ref(const Signature &);
+
+	const Signature &operator*() const {
+		return *ptr;
+	}
+
+	const Signature *operator->() const {
+		return ptr;
+	}
+
+	operator const Signature &() const {
+		return *ptr;
+	}
+
+	bool operator==(const Signature_ref &other) const {
+		return ptr == other.ptr;
+	}
+};
+
+// Joins of interned signatures are cached
+std::optional <Signature_ref> join(const Signature_ref &, const Signature_ref &);
+
+// Every symbol in the real domain, cached by symbol set
+Signature_ref default_signature(std::vector <Symbol>);
+
+template <typename E>
+Signature_ref default_signature(const E &e)
+{
+	return default_signature(e.symbols());
 }
 
 template <typename E>
@@ -57,8 +90,39 @@ Signature default_signature(const Signature &S, const E &e)
 	return result;
 }
 
+// Reals are interned out of line, in the same way as symbols,
+// so that atoms (and hence tree nodes) stay compact
+struct InternedReal {
+	uint32_t index;
+
+	InternedReal(Real);
+
+	Real value() const;
+
+	// Real for an already interned index
+	static InternedReal from(uint32_t);
+
+	operator Real() const {
+		return value();
+	}
+
+	bool operator==(const InternedReal &other) const {
+		return index == other.index;
+	}
+private:
+	// Uninterned, for from
+	InternedReal() = default;
+};
+
+template <>
+struct std::hash <InternedReal> {
+	size_t operator()(const InternedReal &r) const noexcept {
+		return r.index;
+	}
+};
+
 // Leaf element in an expression tree
-using Atom = auto_variant <Integer, Real, Symbol>;
+using Atom = auto_variant <Integer, InternedReal, Symbol>;
 
 // Node in an expression tree
 struct ETN;
@@ -79,12 +143,72 @@ struct _expr_tree_op {
 	ETN_ref next; // For next operand
 };
 
+// Atoms and operations are 24 bytes each, so that a
+// node (with its tag and metadata) fits in a cache line
+static_assert(sizeof(_expr_tree_atom) <= 24);
+static_assert(sizeof(_expr_tree_op) <= 24);
+
+// Structural hash of node metadata, chosen at compile time: 0
+// chains splitmix64 finalizers, 1 uses a seeded 128-bit multiply
+// and fold (as in wyhash), which mixes better at a similar cost
+#ifndef OXIDIUS_HASH
+#define OXIDIUS_HASH 0
+#endif
+
+#ifndef OXIDIUS_HASH_SEED
+#define OXIDIUS_HASH_SEED 0
+#endif
+
+// Summary of the subtree rooted at a node (siblings excluded)
+struct _expr_tree_meta {
+	// Merkle hash over the structure and atoms
+	uint64_t hash;
+
+	// Same, modulo associativity and commutativity; for
+	// AC operations, this is the (order independent) sum
+	// over the operands of the flattened operation
+	uint64_t ac;
+
+	// Bloom filter of contained symbols, by id
+	uint64_t symbols;
+
+	uint32_t size;
+	uint32_t depth;
+
+	static uint64_t symbol_bit(const Symbol &sym) {
+		return 1ull << (sym.id & 63);
+	}
+
+	// Building blocks of the Merkle hash, shared
+	// with the linearized form
+	static uint64_t atom_hash(const Atom &);
+	static uint64_t op_hash(Operation);
+	static uint64_t combine(uint64_t, uint64_t);
+};
+
 struct ETN : auto_variant <_expr_tree_atom, _expr_tree_op> {
-	using auto_variant <_expr_tree_atom, _expr_tree_op> ::auto_variant;
+	_expr_tree_meta meta;
+
+	ETN(const _expr_tree_atom &atom) : auto_variant(atom) {
+		refresh();
+	}
+
+	// Operands must be complete before their parent; if the
+	// operand list is relinked afterwards, refresh is required
+	ETN(const _expr_tree_op &op) : auto_variant(op) {
+		refresh();
+	}
 
 	ETN(const ETN &) = delete;
 	ETN &operator=(const ETN &) = delete;
 
+	// Recompute the metadata from the operands
+	void refresh();
+
+	// Hash modulo AC
+	uint64_t ac_hash() const;
+
+	// Unique symbols, in order of first appearance
 	std::vector <Symbol> symbols() const;
 
 	ETN_ref &next();
@@ -105,9 +229,10 @@ struct ETN : auto_variant <_expr_tree_atom, _expr_tree_op> {
 };
 
 struct Expression {
-	// Expression tree, linearized (root @0)
+	// Expression tree (see LinearExpression
+	// for the linearized form, root @0)
 	ETN *etn;
-	Signature signature;
+	Signature_ref signature;
 
 	std::vector <Symbol> symbols() const;
 
@@ -120,7 +245,7 @@ struct Statement {
 	Expression lhs;
 	Expression rhs;
 	Comparator cmp;
-	Signature signature;
+	Signature_ref signature;
 
 	std::vector <Symbol> symbols() const;
 
@@ -129,4 +254,6 @@ struct Statement {
 	Statement &drop(scoped_memory_manager &);
 };
 
+static_assert(sizeof(ETN) <= 64);
+
 using Symbolic = auto_variant <Expression, Statement>;
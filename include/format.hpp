@@ -7,18 +7,21 @@
 #include "include/lex.hpp"
 #include "include/formalism.hpp"
 #include "include/action.hpp"
+#include "include/linear.hpp"
 
 // Printing
 std::string format_as(const Domain &);
+std::string format_as(const Symbol &);
 std::string format_as(const Atom &);
 std::string format_as(const Token &);
 std::string format_as(const std::vector <Token> &);
 std::string format_as(const ETN &, int = 0);
 std::string format_as(const Signature &);
 std::string format_as(const Expression &);
+std::string format_as(const LinearExpression &);
 std::string format_as(const Statement &);
 std::string format_as(const UnresolvedValue &);
 std::string format_as(const Value &);
 
 // Type string generation
-const Symbol type_string(const UnresolvedValue &);
+const std::string type_string(const UnresolvedValue &);
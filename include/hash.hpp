@@ -1,28 +1,33 @@
 #pragma once
 
+#include <atomic>
 #include <cstdint>
 #include <cstring>
 #include <stack>
-#include <bitset>
+#include <memory>
+#include <optional>
+#include <vector>
 #include <concepts>
+#include <bit>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 #include "include/formalism.hpp"
+#include "include/dag.hpp"
+#include "include/linear.hpp"
+#include "include/match.hpp"
 
 // Hierarchical function(s) split by depth
 using hash_type = uint64_t;
 
-// Atom hashes
+// Atom hashes, as in node metadata
 template <typename T>
 requires std::is_constructible_v <Atom, T>
-hash_type ahash(const T &)
-{
-	return 0;
-}
-
-template <>
-inline hash_type ahash(const Symbol &sym)
+hash_type ahash(const T &t)
 {
-	return std::hash <Symbol> {} (sym);
+	return _expr_tree_meta::atom_hash(t);
 }
 
 template <size_t N>
@@ -58,101 +63,323 @@ hash_type hhash(const Expression &expr)
 	return hhash <N> (expr.etn);
 }
 
-// TODO: analyze this function with a corpus of many distinct expressions
+// Same hashes over the linearized form
+template <size_t N>
+hash_type hhash(const LinearExpression &lexpr, size_t i = 0)
+{
+	if (lexpr.is_op(i)) {
+		int64_t seed = lexpr.op(i);
+		if constexpr (N == 0) {
+			return seed;
+		} else {
+			lexpr.forall_operands(i, [&](size_t j) {
+				seed++;
+				seed ^= hhash <N - 1> (lexpr, j);
+			});
+
+			return seed;
+		}
+	} else {
+		return (N == 0) ? ahash(lexpr.atom(i)) : 0;
+	}
+}
+
+// Full structural hash; O(1) for trees
 hash_type quick_hash(const ETN_ref &);
 hash_type quick_hash(const Expression &);
+hash_type quick_hash(const LinearExpression &);
 
 // Hash table using the quick hash
-using push_marker = std::vector <size_t>;
+// Control bytes, as in Swiss tables: either empty,
+// or the low 7 bits of the hash of an occupied slot
+using control_byte = int8_t;
 
-template <size_t M, size_t N>
-struct ExpressionTable {
-	std::bitset <M * N> valid;
+constexpr control_byte control_empty = -128;
+
+// Slots are probed a group at a time
+#if defined(__AVX2__)
+
+constexpr size_t group_width = 32;
+
+inline uint32_t _group_match(const control_byte *group, control_byte c)
+{
+	__m256i ctrl = _mm256_loadu_si256((const __m256i *) group);
+	return _mm256_movemask_epi8(_mm256_cmpeq_epi8(ctrl, _mm256_set1_epi8(c)));
+}
+
+#elif defined(__SSE2__)
+
+constexpr size_t group_width = 16;
+
+inline uint32_t _group_match(const control_byte *group, control_byte c)
+{
+	__m128i ctrl = _mm_loadu_si128((const __m128i *) group);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(c)));
+}
+
+#else
+
+constexpr size_t group_width = 16;
+
+inline uint32_t _group_match(const control_byte *group, control_byte c)
+{
+	uint32_t mask = 0;
+	for (size_t i = 0; i < group_width; i++)
+		mask |= uint32_t(group[i] == c) << i;
+
+	return mask;
+}
+
+#endif
+
+struct _table_slot {
+	hash_type hash;
+	uint32_t entry;
+
+	// Generation of the entry when it was indexed
+	uint32_t generation;
+};
+
+// Index from hashes to entry indices; the capacity is a power
+// of two (at least a group), and groups are probed linearly
+struct _control_index {
+	std::vector <control_byte> control;
+	std::vector <_table_slot> slots;
+	size_t count = 0;
+
+	static constexpr size_t npos = -1;
+
+	_control_index(size_t = 0);
+
+	size_t capacity() const {
+		return slots.size();
+	}
+
+	size_t groups() const {
+		return slots.size() / group_width;
+	}
+
+	static size_t home(hash_type hash) {
+		return hash >> 7;
+	}
+
+	static control_byte tag(hash_type hash) {
+		return hash & 0x7f;
+	}
+
+	// Position of the first slot satisfying the predicate,
+	// or npos; only slots whose control byte matches the
+	// hash are checked
+	template <typename F>
+	size_t find(hash_type hash, F &&pred, size_t &probes) const {
+		if (slots.empty())
+			return npos;
+
+		size_t mask = groups() - 1;
+		size_t g = home(hash) & mask;
+		for (size_t i = 0; i <= mask; i++, g = (g + 1) & mask) {
+			probes++;
+
+			const control_byte *group = &control[g * group_width];
+			for (uint32_t m = _group_match(group, tag(hash)); m; m &= m - 1) {
+				size_t pos = g * group_width + std::countr_zero(m);
+				if (slots[pos].hash == hash && pred(slots[pos]))
+					return pos;
+			}
+
+			if (_group_match(group, control_empty))
+				return npos;
+		}
+
+		return npos;
+	}
+
+	// Whether n more insertions exceed the maximum load
+	bool full(size_t n = 1) const {
+		return (count + n) * 8 > capacity() * 7;
+	}
+
+	// Insertion of a new entry; returns the number of groups probed
+	size_t insert(const _table_slot &);
+};
+
+struct table_stats {
+	size_t lookups = 0;
+	size_t probes = 0;
+	size_t max_probe = 0;
+	size_t resizes = 0;
+
+	// Lookups that found an entry
+	size_t hits = 0;
+};
+
+// Savepoint of a table, covering its entries
+// and the nodes allocated in its arena
+struct table_epoch {
+	size_t entries;
+	node_arena::mark nodes;
+};
 
-	// M is table size
-	// N is vector size (collision list)
-	Expression data[M][N];
+// Growable table of unique expressions; entries have stable
+// indices
+//
+// Index slots of rolled back entries are left behind; lookups
+// skip them, and migrations drop them. Each rollback starts a
+// new generation, so that a slot left behind never passes for
+// an entry pushed later at the same index
+//
+// The index is resized incrementally, so that no push
+// stalls on a full rehash
+struct ExpressionTable {
+	// Dense storage, in order of insertion, with
+	// the generation each entry was pushed in
+	std::vector <Expression> entries;
+	std::vector <uint32_t> generations;
+	uint32_t generation = 0;
 
-	// TODO: shadow table with higher level hashes (h1, h2, ...)
+	// While growing, the previous index is
+	// migrated a few slots at a time
+	_control_index index;
+	_control_index previous;
+	size_t migrated = 0;
+	size_t pending = 0;
 
-	size_t unique;
-	const size_t table_size = M;
-	const size_t vector_size = N;
+	table_stats stats;
 
 	// Local memory manager, useful
 	// for transporting tables on the fly
 	scoped_memory_manager smm;
 
-	// TODO: next pointer for larger sizes?
+	// Optional hash-consing store; if present, all
+	// pushed expressions must be interned in it and
+	// equality reduces to comparing roots
+	node_store *store;
 
-	ExpressionTable() : valid(0), unique(0) {
-		std::memset(data, 0, sizeof(data));
-	}
+	// If set, expressions equal modulo associativity and
+	// commutativity (of add and multiply) are the same, and
+	// only the first one pushed is kept
+	bool modulo_ac = false;
+
+	static constexpr size_t rehash_step = 8;
+
+	ExpressionTable(node_store * = nullptr, size_t = 64);
 
 	// No copies
 	ExpressionTable(const ExpressionTable &) = delete;
 	ExpressionTable &operator=(const ExpressionTable &) = delete;
 
+	hash_type key(const Expression &expr) const {
+		return modulo_ac ? expr.etn->ac_hash() : quick_hash(expr);
+	}
+
+	bool same(const Expression &A, const Expression &B) const {
+		if (modulo_ac)
+			return ac_equal(A, B);
+
+		if (store)
+			return equal(*store, A.etn, B.etn);
+
+		return equal(A, B);
+	}
+
+	// Expression in the form expected by push
+	Expression intern(const Expression &expr) {
+		if (store)
+			return store->intern(expr);
+
+		return expr;
+	}
+
 	const Expression &flat_at(size_t i) const {
 		// TODO: error outside?
-		return data[i / N][i % N];
-	}
-
-	bool push(const Expression &expr, push_marker &pm) {
-		hash_type h = quick_hash(expr) % M;
-		for (size_t i = 0; i < N; i++) {
-			size_t j = h * N + i;
-			if (!valid[j]) {
-				data[h][i] = expr;
-				valid[j] = true;
-				pm.push_back(j);
-				unique++;
-				return true;
-			}
+		return entries[i];
+	}
 
-			// Check if the same
-			if (equal(data[h][i], expr))
-				return true;
-		}
+	size_t capacity() const {
+		return index.capacity();
+	}
 
-		return false;
+	size_t size() const {
+		return entries.size();
 	}
 
-	bool push(const Expression &expr) {
-		hash_type h = quick_hash(expr) % M;
-		for (size_t i = 0; i < N; i++) {
-			size_t j = h * N + i;
-			if (!valid[j]) {
-				data[h][i] = expr;
-				valid[j] = true;
-				unique++;
-				return true;
-			}
+	double load() const {
+		return double(size()) / capacity();
+	}
 
-			// Check if the same
-			if (equal(data[h][i], expr))
-				return true;
-		}
+	// Index of an equal expression, if present
+	std::optional <size_t> find(const Expression &);
 
-		return false;
-	}
+	// True if the expression is novel
+	bool push(const Expression &);
 
-	void clear(const push_marker &pm) {
-		// TODO: can free immediately as well
-		for (size_t i : pm) {
-			unique -= valid[i];
-			valid[i] = false;
-		}
+	table_epoch checkpoint() const {
+		return table_epoch { entries.size(), smm.arena.checkpoint() };
 	}
+
+	// Discards all entries since the checkpoint, and frees
+	// all nodes allocated in the arena since then as well
+	void rollback(const table_epoch &);
+private:
+	void _truncate(size_t);
+	bool _stale(const _table_slot &) const;
+	void _grow();
+	void _migrate(size_t);
+};
+
+using ExprTable_L1 = ExpressionTable;
+
+// Entry of a concurrent table, built in full before it is
+// published, so that it is immutable once reachable
+struct _concurrent_entry {
+	hash_type hash;
+	Expression expr;
 };
 
-// TODO: hierarchy of tabling (last one is a list of tables)
-// but raw variadics are expensive since everything is stacked
-using ExprTable_L1 = ExpressionTable <41, 4>;
+// Fixed capacity table that many threads can push into at once,
+// lock-free: an entry is built first and then claims an empty slot
+// with a single CAS on its pointer, so no reader ever sees a slot
+// half written, and a failed CAS means another push succeeded. An
+// expression keeps its slot index for the table's lifetime
+//
+// Each worker builds nodes in its own arena, owned by the
+// table so that entries stay valid. Symbols and signatures
+// are still interned globally, and must be created up front
+struct ConcurrentExpressionTable {
+	// Null while empty
+	std::unique_ptr <std::atomic <_concurrent_entry *> []> slots;
+	size_t capacity;
+
+	std::atomic <size_t> unique;
+
+	// One arena per worker
+	std::vector <scoped_memory_manager> arenas;
+
+	struct result {
+		size_t index;
+		bool novel;
+	};
+
+	ConcurrentExpressionTable(size_t, size_t);
+	~ConcurrentExpressionTable();
+
+	// No copies
+	ConcurrentExpressionTable(const ConcurrentExpressionTable &) = delete;
+	ConcurrentExpressionTable &operator=(const ConcurrentExpressionTable &) = delete;
 
-// TODO: msb index for page sized array of validity bits (uint64_t):
-// first check == 0xff..., otherwise we know there is a valid bit/slot
-// the use intrinsic
+	scoped_memory_manager &arena(size_t worker) {
+		return arenas[worker];
+	}
+
+	// Only valid for indices returned by push
+	const Expression &flat_at(size_t i) const {
+		return slots[i].load(std::memory_order_acquire)->expr;
+	}
+
+	// Slot of the expression, inserting it if novel;
+	// std::nullopt only if the table is full
+	std::optional <result> push(const Expression &);
+};
 
 // Displaying table contents and statistics
 void list_table(const ExprTable_L1 &);
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <vector>
+
+#include "include/action.hpp"
+#include "include/formalism.hpp"
+#include "include/match.hpp"
+
+// One direction of a statement, as a rewrite rule
+struct Rule {
+	Expression from;
+	Expression to;
+
+	// Symbol the statement was defined as
+	Symbol owner;
+
+	// Premises, if the statement is the conclusion of an
+	// argument; they are not checked by matching
+	std::vector <Statement> premises;
+
+	// Symbols of the pattern, by first occurrence in preorder
+	// (i.e. by slot); set on insertion, as is the program
+	std::vector <Symbol> symbols;
+	RewriteProgram program;
+};
+
+// Label of a node in the preorder traversal of a pattern; every
+// symbol in a pattern is a variable, whose first occurrence is a
+// wildcard that binds the whole subterm at that position, while
+// later ones are keyed by its slot and must bind an equal subterm
+struct _dtree_key {
+	enum : uint8_t { variable, integer, real, symbol, op } kind;
+	uint32_t arity;
+	uint64_t value;
+
+	bool operator==(const _dtree_key &) const = default;
+
+	static _dtree_key from(const ETN_ref &);
+};
+
+struct _dtree_node {
+	std::vector <std::pair <_dtree_key, uint32_t>> edges;
+	uint32_t wildcard = 0;
+
+	// Rules whose pattern ends here
+	std::vector <uint32_t> rules;
+};
+
+// Rule matching a term, with its bindings borrowed from the term
+struct RuleMatch {
+	uint32_t rule;
+	Substitution sub;
+};
+
+// Discrimination tree over the patterns of all rules, merging
+// their common prefixes; a single traversal of a term finds
+// every rule whose pattern matches it, along with its bindings
+struct DiscriminationTree {
+	// Node 0 is the root; no edge leads back to it,
+	// so a zero wildcard means there is none
+	std::vector <_dtree_node> nodes { 1 };
+
+	// Removed rules are kept, so that ids stay stable
+	std::vector <Rule> rules;
+	std::vector <bool> alive;
+	size_t live = 0;
+
+	size_t insert(const Rule &);
+
+	// Both directions of a statement, or of the
+	// conclusion of an argument
+	void insert(const Statement &, const Symbol &);
+	void insert(const Argument &, const Symbol &);
+
+	void remove(size_t);
+
+	// Removes every rule defined by a symbol
+	void remove(const Symbol &);
+
+	// Rules matching a term, in order of insertion
+	void retrieve(const ETN_ref &, std::vector <uint32_t> &) const;
+	std::vector <uint32_t> retrieve(const Expression &) const;
+
+	// Same, with the bindings of each
+	void match(const ETN_ref &, std::vector <RuleMatch> &) const;
+	std::vector <RuleMatch> match(const Expression &) const;
+
+	size_t size() const {
+		return live;
+	}
+private:
+	// Follows the path of a pattern from a node (preorder),
+	// recording the symbols seen so far; if extend is set,
+	// missing nodes are created, otherwise the result is zero
+	// when the path is not in the tree
+	uint32_t _descend(uint32_t, const ETN_ref &, std::vector <Symbol> &, bool);
+
+	// Visits every node reached by a term, with the pending
+	// subterms and the bindings of the path so far
+	template <typename F>
+	void _traverse(uint32_t, std::vector <ETN_ref> &, std::vector <ETN_ref> &, F &&) const;
+};
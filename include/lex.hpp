@@ -17,8 +17,8 @@ struct Implies {};
 struct At {};
 struct Semicolon {};
 
-struct LiteralString : Symbol {
-	using Symbol::Symbol;
+struct LiteralString : std::string {
+	using std::string::string;
 };
 
 // Grouping
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "include/formalism.hpp"
+#include "include/match.hpp"
+#include "include/memory.hpp"
+#include "include/types.hpp"
+
+// Linearized expression trees; nodes are stored in prefix
+// order in a single array, so that the root is @0, the first
+// operand of a node @i is @i + 1 and its next sibling is @i + size
+enum class _linear_tag : uint8_t {
+	integer,
+	real,
+	symbol,
+	op
+};
+
+struct _linear_node {
+	_linear_tag tag;
+	uint8_t op;
+	uint16_t arity;
+
+	// Number of nodes in the subtree (including this one)
+	uint32_t size;
+
+	// Immediate value (reals and symbols are interned),
+	// or the domain of an operation
+	union {
+		Integer integer;
+		uint32_t real;
+		uint32_t symbol;
+		Domain dom;
+	};
+};
+
+static_assert(sizeof(_linear_node) == 16);
+
+struct LinearExpression {
+	std::vector <_linear_node> nodes;
+
+	bool is_op(size_t i) const {
+		return nodes[i].tag == _linear_tag::op;
+	}
+
+	Operation op(size_t i) const {
+		return (Operation) nodes[i].op;
+	}
+
+	Domain dom(size_t i) const {
+		return nodes[i].dom;
+	}
+
+	// Index of the next sibling of a node
+	size_t skip(size_t i) const {
+		return i + nodes[i].size;
+	}
+
+	Atom atom(size_t) const;
+
+	template <typename F>
+	void forall_operands(size_t i, F &&ftn) const {
+		size_t end = skip(i);
+		for (size_t j = i + 1; j < end; j = skip(j))
+			ftn(j);
+	}
+
+	std::vector <Symbol> symbols() const;
+
+	// Expression tree of the subtree @i
+	ETN_ref tree(size_t = 0) const;
+	ETN_ref tree(scoped_memory_manager &, size_t = 0) const;
+
+	static LinearExpression from(const ETN_ref &);
+};
+
+LinearExpression linearize(const Expression &);
+
+bool equal(const LinearExpression &, size_t, const LinearExpression &, size_t);
+bool equal(const LinearExpression &, const LinearExpression &);
+
+std::optional <Substitution> match(const LinearExpression &, const LinearExpression &);
@@ -1,19 +1,100 @@
 #pragma once
 
-#include <unordered_map>
+#include <vector>
 
 #include "include/memory.hpp"
 #include "include/types.hpp"
 #include "include/formalism.hpp"
 
-using _substitution_base = std::unordered_map <Symbol, Expression>;
+struct _binding {
+	Symbol symbol;
+	ETN_ref etn;
+};
+
+// Bindings of pattern symbols, in the order they were made,
+// which doubles as the trail for undoing them; patterns have few
+// symbols, so they are found by a scan, and the first few are
+// kept inline, so that neither copying nor binding allocates
+//
+// Bindings either own a copy of the matched subtree, or borrow
+// it from the victim (see the overloads of match), in which case
+// the victim must outlive the substitution and it must never be
+// dropped
+struct Substitution {
+	static constexpr size_t fixed_capacity = 8;
+
+	// Bindings are in spilled instead once
+	// there are more than fit inline
+	_binding fixed[fixed_capacity];
+	std::vector <_binding> spilled;
+	uint32_t count = 0;
+
+	// Bound tree, or null if the symbol is unbound
+	ETN_ref find(const Symbol &sym) const {
+		for (const _binding &b : *this) {
+			if (b.symbol == sym)
+				return b.etn;
+		}
+
+		return nullptr;
+	}
+
+	bool contains(const Symbol &sym) const {
+		return find(sym);
+	}
+
+	// The symbol must not be bound yet
+	void bind(const Symbol &, ETN_ref);
+
+	// Binding made i-th
+	const _binding &operator[](size_t i) const {
+		return data()[i];
+	}
+
+	// Undoing every binding made since a mark
+	size_t mark() const {
+		return count;
+	}
+
+	void undo(size_t m) {
+		count = m;
+		if (!spilled.empty())
+			spilled.resize(m);
+	}
+
+	void clear() {
+		undo(0);
+	}
+
+	size_t size() const {
+		return count;
+	}
 
-struct Substitution : _substitution_base {
-	using _substitution_base::_substitution_base;
+	const _binding *data() const {
+		return spilled.empty() ? fixed : spilled.data();
+	}
+
+	const _binding *begin() const {
+		return data();
+	}
+
+	const _binding *end() const {
+		return data() + count;
+	}
 
 	ETN_ref apply(const ETN_ref &);
 	Expression apply(const Expression &);
 
+	// Applying with the result in the arena of a scope
+	ETN_ref apply(const ETN_ref &, scoped_memory_manager &);
+	Expression apply(const Expression &, scoped_memory_manager &);
+
+	// Applying persistently; the result shares every unchanged
+	// subtree with its input and with the bound expressions,
+	// which must therefore outlive it and never be mutated
+	ETN_ref apply_shared(const ETN_ref &, scoped_memory_manager &);
+	Expression apply_shared(const Expression &, scoped_memory_manager &);
+
 	Substitution &drop(scoped_memory_manager &);
 };
 
@@ -21,7 +102,162 @@ bool equal(const Atom &, const Atom &);
 bool equal(const ETN_ref &, const ETN_ref &);
 bool equal(const Expression &, const Expression &);
 
+// Total order on terms modulo associativity and commutativity
+// of add and multiply; zero if and only if equal modulo AC
+int ac_compare(const ETN_ref &, const ETN_ref &);
+bool ac_equal(const ETN_ref &, const ETN_ref &);
+bool ac_equal(const Expression &, const Expression &);
+
+// Canonical form modulo AC (in the arena of a scope); nested
+// AC operations are flattened into one, with sorted operands
+ETN_ref canonical(const ETN_ref &, scoped_memory_manager &);
+Expression canonical(const Expression &, scoped_memory_manager &);
+
 std::optional <Substitution> add_substitution(const Substitution &, const Symbol &, const Expression &);
 std::optional <Substitution> join(const Substitution &, const Substitution &);
 std::optional <Substitution> match(const ETN_ref &, const ETN_ref &);
 std::optional <Substitution> match(const Expression &, const Expression &);
+
+// Matching with the bindings in the arena of a scope
+std::optional <Substitution> match(const ETN_ref &, const ETN_ref &, scoped_memory_manager &);
+std::optional <Substitution> match(const Expression &, const Expression &, scoped_memory_manager &);
+
+// Matching in place, extending the bindings of a substitution;
+// on failure, it is left as it was, and the nodes copied for
+// it are freed from the arena
+bool match(const ETN_ref &, const ETN_ref &, Substitution &, scoped_memory_manager &);
+
+// Same, with bindings borrowed from the victim; nothing is
+// allocated, and nothing is copied until the substitution is
+// applied (if at all, with apply_shared)
+bool match(const ETN_ref &, const ETN_ref &, Substitution &);
+
+// Matching modulo associativity and commutativity of add and
+// multiply (in the arena of a scope); operands of AC operations
+// are flattened and matched in any order, and a symbol may bind
+// several of them at once, as a (right nested) operation over
+// them. Every distinct substitution is returned; AC operations
+// are limited to 64 operands
+//
+// Bindings are borrowed from the victim, except for operations
+// gathered from several operands, whose spine is built in the
+// arena of the scope (sharing the operands themselves)
+std::vector <Substitution> ac_match(const ETN_ref &, const ETN_ref &, scoped_memory_manager &);
+std::vector <Substitution> ac_match(const Expression &, const Expression &, scoped_memory_manager &);
+
+// Pattern compiled into a flat program, run against a victim
+// without recursion; register r holds the victim node at depth
+// r of the pattern, and moves along its operands as they are
+// matched, so that no stack of parents is needed
+struct MatchProgram {
+	enum Code : uint8_t {
+		// Victim must be the operation (and no smaller or
+		// shallower than the pattern); loads its first
+		// operand into the next register
+		check,
+
+		// Moves a register to its next sibling
+		next,
+
+		// First and later occurrences of a symbol
+		bind,
+		compare,
+
+		// Victim must be an equal constant
+		constant
+	};
+
+	struct instruction {
+		Code code;
+		uint16_t reg;
+		Operation op;
+		uint32_t size;
+		uint32_t depth;
+		Symbol symbol;
+
+		// Index of the symbol, by first occurrence
+		uint32_t slot;
+
+		// Pattern node, for constants
+		ETN_ref etn;
+	};
+
+	std::vector <instruction> code;
+	size_t registers = 0;
+	size_t slots = 0;
+
+	static MatchProgram compile(const ETN_ref &);
+
+	// Same result as match(), with bindings in the arena of a
+	// scope; the substitution is cleared first, and on failure
+	// (when the copied nodes are freed as well)
+	bool run(const ETN_ref &, Substitution &, scoped_memory_manager &) const;
+
+	// Same, with bindings borrowed from the victim
+	bool run(const ETN_ref &, Substitution &) const;
+private:
+	// Bindings are kept by a binder, which is given
+	// every bind and compare instruction
+	template <typename B>
+	bool _run(const ETN_ref &, B &&) const;
+
+	friend struct RewriteProgram;
+};
+
+// Oriented statement compiled into a single operation, which
+// matches the pattern (borrowing bindings into registers) and
+// builds the instance of the replacement straight into an arena,
+// with no substitution in between; as with apply_shared, the
+// instance shares the bound subtrees and every part of the
+// replacement without symbols of the pattern
+struct RewriteProgram {
+	enum Code : uint8_t {
+		// Pushes a subtree of the replacement as is
+		share,
+
+		// Pushes the subtree bound to a slot
+		bound,
+
+		// Pops the operands of an operation,
+		// and pushes the operation over them
+		make
+	};
+
+	struct instruction {
+		Code code;
+		Operation op;
+		Domain dom;
+		uint32_t slot;
+		uint32_t arity;
+		ETN_ref etn;
+	};
+
+	MatchProgram pattern;
+
+	// Replacement, in postorder
+	std::vector <instruction> build;
+	size_t stack = 0;
+
+	// Whether the replacement has no symbols besides those of
+	// the pattern, in which case the signature of the victim
+	// covers every instance
+	bool closed = true;
+
+	static RewriteProgram compile(const ETN_ref &, const ETN_ref &);
+	static RewriteProgram compile(const Expression &, const Expression &);
+
+	// Instance of the replacement for a victim, or null if
+	// the pattern does not match; the victim must outlive it
+	ETN_ref apply(const ETN_ref &, scoped_memory_manager &) const;
+
+	// Instances of closed replacements keep the signature of
+	// the victim, others get the default one
+	std::optional <Expression> apply(const Expression &, scoped_memory_manager &) const;
+
+	// Instance of the replacement for a match made elsewhere, with
+	// one binding per slot, in order (as by DiscriminationTree)
+	ETN_ref instantiate(const Substitution &, scoped_memory_manager &) const;
+private:
+	// Builds the replacement over the subtrees bound to each slot
+	ETN_ref _build(ETN_ref *, scoped_memory_manager &) const;
+};
@@ -1,6 +1,17 @@
 #pragma once
 
 #include <queue>
+#include <unordered_set>
+
+// Ownership checks on dropped nodes (double free detection);
+// compiled out in release builds unless requested explicitly
+#ifndef OXIDIUS_MEMORY_CHECKS
+#ifdef NDEBUG
+#define OXIDIUS_MEMORY_CHECKS 0
+#else
+#define OXIDIUS_MEMORY_CHECKS 1
+#endif
+#endif
 
 struct ETN;
 struct Expression;
@@ -8,13 +19,70 @@ struct Statement;
 struct Substitution;
 struct UnresolvedValue;
 
+struct _expr_tree_atom;
+struct _expr_tree_op;
+
 using ETN_ref = ETN *;
 
+// Bump allocator for expression tree nodes; nodes are
+// placed contiguously in slabs and the arena is released
+// as a whole, never node by node
+struct node_arena {
+	struct slab;
+
+	slab *head;
+	size_t count;
+
+	node_arena() : head(nullptr), count(0) {}
+
+	~node_arena();
+
+	// No copies
+	node_arena(const node_arena &) = delete;
+	node_arena &operator=(const node_arena &) = delete;
+
+	void *allocate();
+
+	// Position of the arena, to roll back to
+	struct mark {
+		slab *head;
+		size_t used;
+	};
+
+	mark checkpoint() const;
+
+	// Frees every node allocated since the checkpoint; slabs
+	// spliced in from other arenas are not tracked
+	void rollback(const mark &);
+
+	// Moves all slabs of the other arena into this one
+	void splice(node_arena &);
+
+	void release();
+};
+
 struct scoped_memory_manager {
 	std::queue <ETN_ref> deferred;
 
+#if OXIDIUS_MEMORY_CHECKS
+	// Nodes currently owned through drop
+	std::unordered_set <ETN_ref> owned;
+#endif
+
+	// Nodes allocated directly in this scope
+	node_arena arena;
+
+	// Statistics
+	size_t dropped = 0;
+	size_t released = 0;
+
+	scoped_memory_manager() = default;
+
 	~scoped_memory_manager();
 
+	ETN_ref make(const _expr_tree_atom &);
+	ETN_ref make(const _expr_tree_op &);
+
 	void transfer_to(scoped_memory_manager &);
 
 	void drop(ETN_ref);
@@ -28,6 +96,14 @@ struct scoped_memory_manager {
 	// TODO: drop(smm) for Expressions and Statements (maybe even ETNs)
 };
 
+// Displaying scope statistics
+void list_scope(const scoped_memory_manager &);
+
 // Explicit cloning
 ETN_ref clone(const ETN_ref &);
 ETN_ref clone_soft(const ETN_ref &);
+
+// Cloning into the arena of a scope; the
+// results must not be dropped individually
+ETN_ref clone(const ETN_ref &, scoped_memory_manager &);
+ETN_ref clone_soft(const ETN_ref &, scoped_memory_manager &);
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
 #include <concepts>
 
@@ -12,8 +13,36 @@ enum Domain {
 	complex
 };
 
+// Interned names; each distinct name is assigned a
+// dense 32-bit identifier once, at construction
+struct Symbol {
+	uint32_t id;
+
+	Symbol();
+	Symbol(const char *);
+	Symbol(const std::string &);
+
+	const std::string &str() const;
+
+	bool operator==(const Symbol &other) const {
+		return id == other.id;
+	}
+
+	// Symbol for an already interned identifier
+	static Symbol from(uint32_t);
+
+	// Number of distinct names interned so far
+	static size_t count();
+};
+
+template <>
+struct std::hash <Symbol> {
+	size_t operator()(const Symbol &sym) const noexcept {
+		return sym.id;
+	}
+};
+
 // Basic types
 using Truth = bool;
 using Integer = long long int;
 using Real = long double;
-using Symbol = std::string;
@@ -0,0 +1,155 @@
+#include "include/dag.hpp"
+#include "include/match.hpp"
+
+// Node keys
+bool _node_key::operator==(const _node_key &other) const
+{
+	if (index != other.index || down != other.down || next != other.next)
+		return false;
+
+	if (index == 0)
+		return equal(atom, other.atom);
+
+	return op == other.op && dom == other.dom;
+}
+
+size_t _node_key_hash::operator()(const _node_key &key) const
+{
+	size_t seed = key.index;
+	if (key.index == 0) {
+		seed ^= std::visit([](const auto &v) {
+			return std::hash <std::decay_t <decltype(v)>> {} (v);
+		}, key.atom);
+	} else {
+		seed ^= key.op | (size_t(key.dom) << 8);
+	}
+
+	auto mix = [&](const void *ptr) {
+		size_t h = std::hash <const void *> {} (ptr);
+		seed ^= h + 0x9e3779b97f4a7c15 + (seed << 6) + (seed >> 2);
+	};
+
+	mix(key.down);
+	mix(key.next);
+
+	return seed;
+}
+
+// Node store
+ETN_ref node_store::make(const Atom &atom, ETN_ref next)
+{
+	_node_key key {
+		.index = 0,
+		.op = none,
+		.dom = real,
+		.atom = atom,
+		.down = nullptr,
+		.next = next
+	};
+
+	auto it = nodes.find(key);
+	if (it != nodes.end()) {
+		hits++;
+		return it->second;
+	}
+
+	_expr_tree_atom node(atom);
+	node.next = next;
+
+	ETN_ref ref = smm.make(node);
+	nodes.emplace(key, ref);
+	misses++;
+
+	return ref;
+}
+
+ETN_ref node_store::make(Operation op, Domain dom, ETN_ref down, ETN_ref next)
+{
+	_node_key key {
+		.index = 1,
+		.op = op,
+		.dom = dom,
+		.atom = Integer(0),
+		.down = down,
+		.next = next
+	};
+
+	auto it = nodes.find(key);
+	if (it != nodes.end()) {
+		hits++;
+		return it->second;
+	}
+
+	ETN_ref ref = smm.make(_expr_tree_op {
+		.op = op,
+		.dom = dom,
+		.down = down,
+		.next = next
+	});
+
+	nodes.emplace(key, ref);
+	misses++;
+
+	return ref;
+}
+
+static ETN_ref _intern(node_store &store, const ETN_ref &ref, ETN_ref next)
+{
+	if (ref->is <_expr_tree_atom> ())
+		return store.make(ref->as <_expr_tree_atom> ().atom, next);
+
+	auto tree = ref->as <_expr_tree_op> ();
+
+	// Operands are interned from last to first
+	std::vector <ETN_ref> operands;
+
+	ETN_ref head = tree.down;
+	while (head) {
+		operands.push_back(head);
+		head = head->next();
+	}
+
+	ETN_ref down = nullptr;
+	for (auto it = operands.rbegin(); it != operands.rend(); it++)
+		down = _intern(store, *it, down);
+
+	return store.make(tree.op, tree.dom, down, next);
+}
+
+ETN_ref node_store::intern(const ETN_ref &ref)
+{
+	return _intern(*this, ref, nullptr);
+}
+
+Expression node_store::intern(const Expression &expr)
+{
+	return Expression {
+		.etn = intern(expr.etn),
+		.signature = expr.signature
+	};
+}
+
+ETN_ref node_store::with_next(const ETN_ref &ref, ETN_ref next)
+{
+	if (ref->next() == next)
+		return ref;
+
+	if (ref->is <_expr_tree_atom> ())
+		return make(ref->as <_expr_tree_atom> ().atom, next);
+
+	auto tree = ref->as <_expr_tree_op> ();
+	return make(tree.op, tree.dom, tree.down, next);
+}
+
+ETN_ref node_store::head(const ETN_ref &ref)
+{
+	return with_next(ref, nullptr);
+}
+
+bool equal(node_store &store, const ETN_ref &A, const ETN_ref &B)
+{
+	if (A == B)
+		return true;
+
+	return store.head(A) == store.head(B);
+}
@@ -0,0 +1,409 @@
+#include <algorithm>
+#include <limits>
+#include <unordered_set>
+
+#include "include/egraph.hpp"
+#include "include/match.hpp"
+
+// Nodes
+bool ENode::operator==(const ENode &other) const
+{
+	if (op != other.op || operands != other.operands)
+		return false;
+
+	if (op != none)
+		return dom == other.dom;
+
+	return equal(atom, other.atom);
+}
+
+size_t _enode_hash::operator()(const ENode &node) const
+{
+	size_t seed = node.op;
+	if (node.op == none) {
+		seed ^= std::visit([](const auto &v) {
+			return std::hash <std::decay_t <decltype(v)>> {} (v);
+		}, node.atom);
+	} else {
+		seed ^= size_t(node.dom) << 8;
+	}
+
+	for (EClassId operand : node.operands)
+		seed ^= operand + 0x9e3779b97f4a7c15 + (seed << 6) + (seed >> 2);
+
+	return seed;
+}
+
+// Union-find, with path halving
+EClassId EGraph::find(EClassId id)
+{
+	while (parent[id] != id) {
+		parent[id] = parent[parent[id]];
+		id = parent[id];
+	}
+
+	return id;
+}
+
+EClassId EGraph::add(ENode node)
+{
+	for (EClassId &operand : node.operands)
+		operand = find(operand);
+
+	auto it = memo.find(node);
+	if (it != memo.end())
+		return find(it->second);
+
+	EClassId id = parent.size();
+	parent.push_back(id);
+	classes.emplace_back();
+	live++;
+
+	for (EClassId operand : node.operands)
+		classes[operand].parents.emplace_back(node, id);
+
+	classes[id].nodes.push_back(node);
+	memo.emplace(std::move(node), id);
+
+	return id;
+}
+
+EClassId EGraph::add(const ETN_ref &etn)
+{
+	if (etn->is <_expr_tree_atom> ()) {
+		return add(ENode {
+			.op = none,
+			.atom = etn->as <_expr_tree_atom> ().atom
+		});
+	}
+
+	const auto &tree = etn->as <_expr_tree_op> ();
+
+	ENode node {
+		.op = tree.op,
+		.dom = tree.dom,
+		.atom = Integer(0)
+	};
+
+	etn->forall_operands([&](const ETN_ref &head) {
+		node.operands.push_back(add(head));
+	});
+
+	return add(std::move(node));
+}
+
+EClassId EGraph::merge(EClassId a, EClassId b)
+{
+	a = find(a);
+	b = find(b);
+	if (a == b)
+		return a;
+
+	// The larger class stays the root, so
+	// that fewer entries are moved
+	size_t wa = classes[a].nodes.size() + classes[a].parents.size();
+	size_t wb = classes[b].nodes.size() + classes[b].parents.size();
+	if (wa < wb)
+		std::swap(a, b);
+
+	parent[b] = a;
+	live--;
+
+	_eclass &from = classes[b];
+	_eclass &to = classes[a];
+
+	to.nodes.insert(to.nodes.end(),
+		std::make_move_iterator(from.nodes.begin()),
+		std::make_move_iterator(from.nodes.end()));
+
+	to.parents.insert(to.parents.end(),
+		std::make_move_iterator(from.parents.begin()),
+		std::make_move_iterator(from.parents.end()));
+
+	from = {};
+	pending.push_back(a);
+
+	return a;
+}
+
+// Restores the invariants deferred by merge: parents of merged
+// classes are rehashed under their canonical operands, merging
+// those that turn out to be congruent (which may cascade), then
+// the nodes of every class are made canonical and unique
+void EGraph::rebuild()
+{
+	std::unordered_map <ENode, EClassId, _enode_hash> unique;
+
+	while (!pending.empty()) {
+		std::vector <EClassId> todo;
+		std::swap(todo, pending);
+
+		for (EClassId id : todo) {
+			id = find(id);
+
+			auto parents = std::move(classes[id].parents);
+			classes[id].parents.clear();
+
+			unique.clear();
+			for (auto &[node, owner] : parents) {
+				memo.erase(node);
+				for (EClassId &operand : node.operands)
+					operand = find(operand);
+
+				auto [it, inserted] = memo.emplace(node, find(owner));
+				if (!inserted)
+					it->second = merge(it->second, owner);
+
+				unique.insert_or_assign(std::move(node), it->second);
+			}
+
+			auto &kept = classes[find(id)].parents;
+			for (auto &[node, owner] : unique)
+				kept.emplace_back(node, owner);
+		}
+	}
+
+	std::unordered_set <ENode, _enode_hash> seen;
+	for (EClassId id = 0; id < classes.size(); id++) {
+		if (parent[id] != id)
+			continue;
+
+		seen.clear();
+		std::erase_if(classes[id].nodes, [&](ENode &node) {
+			for (EClassId &operand : node.operands)
+				operand = find(operand);
+
+			return !seen.insert(node).second;
+		});
+	}
+}
+
+// Matching a pattern against the nodes of a class, by
+// backtracking over the slots of its variables; each
+// solution is passed to a continuation
+using _ematch_continuation = std::function <void ()>;
+
+struct _ematcher {
+	static constexpr EClassId unbound = std::numeric_limits <EClassId>::max();
+
+	EGraph &graph;
+	const _erule &rule;
+	std::vector <EClassId> &slots;
+
+	// Matches still to be found
+	size_t remaining;
+
+	void match(const ETN_ref &, EClassId, const _ematch_continuation &);
+	void sequence(ETN_ref, const ENode &, size_t, const _ematch_continuation &);
+};
+
+void _ematcher::match(const ETN_ref &source, EClassId id, const _ematch_continuation &k)
+{
+	if (!remaining)
+		return;
+
+	id = graph.find(id);
+
+	if (source->is <_expr_tree_atom> ()) {
+		const Atom &atom = source->as <_expr_tree_atom> ().atom;
+
+		// Variables bind whole classes
+		if (atom.is <Symbol> ()) {
+			auto it = std::find(rule.symbols.begin(), rule.symbols.end(), atom.as <Symbol> ());
+			EClassId &slot = slots[it - rule.symbols.begin()];
+			if (slot == unbound) {
+				slot = id;
+				k();
+				slot = unbound;
+			} else if (slot == id) {
+				k();
+			}
+
+			return;
+		}
+
+		// Constants need an equal atom in the class
+		for (const ENode &node : graph.classes[id].nodes) {
+			if (node.op == none && equal(node.atom, atom))
+				return k();
+		}
+
+		return;
+	}
+
+	const auto &tree = source->as <_expr_tree_op> ();
+	for (const ENode &node : graph.classes[id].nodes) {
+		if (node.op == tree.op)
+			sequence(tree.down, node, 0, k);
+	}
+}
+
+void _ematcher::sequence(ETN_ref head, const ENode &node, size_t i, const _ematch_continuation &k)
+{
+	if (!head || i == node.operands.size()) {
+		if (!head && i == node.operands.size())
+			k();
+
+		return;
+	}
+
+	match(head, node.operands[i], [&]() {
+		sequence(head->next(), node, i + 1, k);
+	});
+}
+
+// Each match is appended as the class followed by its slots;
+// returns the number of matches, which is at most the limit
+size_t EGraph::_ematch(const _erule &rule, EClassId id, std::vector <EClassId> &result, size_t limit)
+{
+	std::vector <EClassId> slots(rule.symbols.size(), _ematcher::unbound);
+
+	_ematcher matcher { *this, rule, slots, limit };
+	matcher.match(rule.from, id, [&]() {
+		result.push_back(id);
+		result.insert(result.end(), slots.begin(), slots.end());
+		matcher.remaining--;
+	});
+
+	return limit - matcher.remaining;
+}
+
+EClassId EGraph::_instantiate(const ETN_ref &etn, const _erule &rule, const EClassId *slots)
+{
+	if (etn->is <_expr_tree_atom> ()) {
+		const Atom &atom = etn->as <_expr_tree_atom> ().atom;
+
+		// Symbols only on this side are left as they are
+		if (atom.is <Symbol> ()) {
+			auto it = std::find(rule.symbols.begin(), rule.symbols.end(), atom.as <Symbol> ());
+			if (it != rule.symbols.end())
+				return slots[it - rule.symbols.begin()];
+		}
+
+		return add(ENode {
+			.op = none,
+			.atom = atom
+		});
+	}
+
+	const auto &tree = etn->as <_expr_tree_op> ();
+
+	ENode node {
+		.op = tree.op,
+		.dom = tree.dom,
+		.atom = Integer(0)
+	};
+
+	etn->forall_operands([&](const ETN_ref &head) {
+		node.operands.push_back(_instantiate(head, rule, slots));
+	});
+
+	return add(std::move(node));
+}
+
+bool EGraph::saturate(const std::vector <Statement> &stmts, size_t iterations, size_t limit)
+{
+	std::vector <_erule> rules;
+	for (const Statement &stmt : stmts) {
+		rules.push_back({ stmt.lhs.etn, stmt.rhs.etn, stmt.lhs.etn->symbols() });
+		rules.push_back({ stmt.rhs.etn, stmt.lhs.etn, stmt.rhs.etn->symbols() });
+	}
+
+	std::vector <std::vector <EClassId>> matches(rules.size());
+	for (size_t n = 0; n < iterations; n++) {
+		// Every match is found before any is applied, so
+		// that the graph does not change under them; there
+		// are no more for each rule than the node limit, as
+		// the matches of a growing graph can far outnumber
+		// its nodes
+		bool complete = true;
+		for (size_t r = 0; r < rules.size(); r++) {
+			matches[r].clear();
+
+			size_t budget = limit;
+			for (EClassId id = 0; id < classes.size() && budget; id++) {
+				if (parent[id] == id)
+					budget -= _ematch(rules[r], id, matches[r], budget);
+			}
+
+			complete &= budget > 0;
+		}
+
+		size_t before = size();
+		bool merged = false;
+
+		for (size_t r = 0; r < rules.size() && size() < limit; r++) {
+			size_t stride = rules[r].symbols.size() + 1;
+			for (size_t i = 0; i < matches[r].size() && size() < limit; i += stride) {
+				EClassId id = _instantiate(rules[r].to, rules[r], &matches[r][i + 1]);
+				if (find(id) != find(matches[r][i])) {
+					merge(id, matches[r][i]);
+					merged = true;
+				}
+			}
+		}
+
+		rebuild();
+
+		if (size() >= limit)
+			return false;
+		if (complete && !merged && size() == before)
+			return true;
+	}
+
+	return false;
+}
+
+ETN_ref EGraph::_build(EClassId id, const std::vector <uint32_t> &choice, scoped_memory_manager &smm)
+{
+	const ENode &node = classes[id].nodes[choice[id]];
+	if (node.op == none)
+		return smm.make(_expr_tree_atom(node.atom));
+
+	// Operands are linked from last to first
+	ETN_ref down = nullptr;
+	for (size_t i = node.operands.size(); i-- > 0; ) {
+		ETN_ref operand = _build(find(node.operands[i]), choice, smm);
+		operand->next() = down;
+		down = operand;
+	}
+
+	return smm.make(_expr_tree_op {
+		.op = node.op,
+		.dom = node.dom,
+		.down = down,
+		.next = nullptr
+	});
+}
+
+// Costs of classes are relaxed until they settle, as in
+// Bellman-Ford; positive costs keep the choices acyclic
+ETN_ref EGraph::extract(EClassId id, scoped_memory_manager &smm, const ECost &cost)
+{
+	std::vector <double> best(classes.size(), std::numeric_limits <double>::infinity());
+	std::vector <uint32_t> choice(classes.size(), 0);
+
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (EClassId c = 0; c < classes.size(); c++) {
+			if (parent[c] != c)
+				continue;
+
+			const auto &nodes = classes[c].nodes;
+			for (uint32_t i = 0; i < nodes.size(); i++) {
+				double total = cost(nodes[i]);
+				for (EClassId operand : nodes[i].operands)
+					total += best[find(operand)];
+
+				if (total < best[c]) {
+					best[c] = total;
+					choice[c] = i;
+					changed = true;
+				}
+			}
+		}
+	}
+
+	return _build(find(id), choice, smm);
+}
@@ -1,4 +1,9 @@
-#include <queue>
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <limits>
+#include <unordered_set>
 
 #include "include/format.hpp"
 #include "include/formalism.hpp"
@@ -7,7 +12,7 @@
 std::vector <Comparator> Comparator::list { { "=" } };
 
 // Signature
-bool add_signature(Signature &S, const std::string &sym, Domain dom)
+bool add_signature(Signature &S, const Symbol &sym, Domain dom)
 {
 	if (S.count(sym) && S[sym] != dom) {
 		fmt::println("conflicting domain signature for symbol '{}' between {} and {}", sym, S[sym], dom);
@@ -29,29 +34,335 @@ std::optional <Signature> join(const Signature &A, const Signature &B)
 	return result;
 }
 
+// Signature pool
+struct _signature_hash {
+	size_t operator()(const Signature &S) const {
+		// Order independent, as maps are unordered
+		size_t h = S.size();
+		for (const auto &[s, dom] : S)
+			h += std::hash <uint64_t> {} ((uint64_t(s.id) << 2) | dom) * 0x9e3779b97f4a7c15;
+
+		return h;
+	}
+};
+
+struct _symbol_set_hash {
+	size_t operator()(const std::vector <uint32_t> &ids) const {
+		size_t h = ids.size();
+		for (uint32_t id : ids)
+			h ^= id + 0x9e3779b97f4a7c15 + (h << 6) + (h >> 2);
+
+		return h;
+	}
+};
+
+struct _pair_hash {
+	size_t operator()(const std::pair <const Signature *, const Signature *> &p) const {
+		size_t h = std::hash <const void *> {} (p.first);
+		return h ^ (std::hash <const void *> {} (p.second) + 0x9e3779b97f4a7c15 + (h << 6) + (h >> 2));
+	}
+};
+
+struct _signature_pool {
+	// Node based, so interned signatures never move
+	std::unordered_set <Signature, _signature_hash> signatures;
+
+	// Caches; failed joins are recorded as null
+	std::unordered_map <std::pair <const Signature *, const Signature *>, const Signature *, _pair_hash> joins;
+	std::unordered_map <std::vector <uint32_t>, const Signature *, _symbol_set_hash> defaults;
+
+	const Signature *empty;
+
+	_signature_pool() {
+		empty = intern(Signature());
+	}
+
+	const Signature *intern(const Signature &S) {
+		return &*signatures.insert(S).first;
+	}
+};
+
+static _signature_pool &signature_pool()
+{
+	static _signature_pool pool;
+	return pool;
+}
+
+Signature_ref::Signature_ref() : ptr(signature_pool().empty) {}
+
+Signature_ref::Signature_ref(const Signature &S) : ptr(signature_pool().intern(S)) {}
+
+std::optional <Signature_ref> join(const Signature_ref &A, const Signature_ref &B)
+{
+	if (A == B)
+		return A;
+
+	auto &pool = signature_pool();
+
+	auto key = std::make_pair(A.ptr, B.ptr);
+
+	auto it = pool.joins.find(key);
+	if (it == pool.joins.end()) {
+		auto joined = join(*A, *B);
+
+		const Signature *result = nullptr;
+		if (joined)
+			result = pool.intern(joined.value());
+
+		it = pool.joins.emplace(key, result).first;
+	}
+
+	if (!it->second)
+		return std::nullopt;
+
+	Signature_ref result;
+	result.ptr = it->second;
+	return result;
+}
+
+Signature_ref default_signature(std::vector <Symbol> symbols)
+{
+	auto &pool = signature_pool();
+
+	std::vector <uint32_t> ids;
+	ids.reserve(symbols.size());
+	for (const auto &s : symbols)
+		ids.push_back(s.id);
+
+	std::sort(ids.begin(), ids.end());
+	ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+
+	auto it = pool.defaults.find(ids);
+	if (it == pool.defaults.end()) {
+		Signature result;
+		for (const auto &s : symbols)
+			result[s] = real;
+
+		it = pool.defaults.emplace(ids, pool.intern(result)).first;
+	}
+
+	Signature_ref result;
+	result.ptr = it->second;
+	return result;
+}
+
+// Interned reals, keyed by their bits rather than by ==, so that
+// -0.0 keeps its sign and every NaN is the same (quiet) NaN
+struct _real_bits {
+	uint64_t low;
+	uint64_t high;
+
+	bool operator==(const _real_bits &) const = default;
+
+	static _real_bits from(Real r) {
+		if (std::isnan(r))
+			r = std::numeric_limits <Real>::quiet_NaN();
+
+		static_assert(sizeof(Real) == 8 || sizeof(Real) == 16);
+
+		auto words = std::bit_cast <std::array <uint64_t, sizeof(Real) / 8>> (r);
+
+		_real_bits bits { words.front(), words.back() };
+
+		// x87 extended precision uses 80 of the 128 bits
+		if (std::numeric_limits <Real>::digits == 64 && sizeof(Real) == 16)
+			bits.high &= 0xffff;
+
+		return bits;
+	}
+};
+
+struct _real_bits_hash {
+	size_t operator()(const _real_bits &bits) const {
+		return bits.low ^ (bits.high * 0x9e3779b97f4a7c15);
+	}
+};
+
+struct _real_table {
+	std::vector <Real> values;
+	std::unordered_map <_real_bits, uint32_t, _real_bits_hash> indices;
+
+	uint32_t intern(Real r) {
+		_real_bits bits = _real_bits::from(r);
+
+		auto it = indices.find(bits);
+		if (it != indices.end())
+			return it->second;
+
+		uint32_t index = values.size();
+		values.push_back(r);
+		indices.emplace(bits, index);
+		return index;
+	}
+};
+
+static _real_table &real_table()
+{
+	static _real_table table;
+	return table;
+}
+
+InternedReal::InternedReal(Real r) : index(real_table().intern(r)) {}
+
+Real InternedReal::value() const
+{
+	return real_table().values[index];
+}
+
+InternedReal InternedReal::from(uint32_t index)
+{
+	InternedReal r;
+	r.index = index;
+	return r;
+}
+
 // ETN
+#if OXIDIUS_HASH == 1
+
+static uint64_t _mix(uint64_t a, uint64_t b)
+{
+	__uint128_t r = (__uint128_t) (a ^ 0xa0761d6478bd642f) * (b ^ 0xe7037ed1a0b428db);
+	return uint64_t(r) ^ uint64_t(r >> 64);
+}
+
+#else
+
+static uint64_t _mix(uint64_t a, uint64_t b)
+{
+	// Finalizer from splitmix64
+	uint64_t x = a + b;
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111eb;
+	x ^= x >> 31;
+	return x;
+}
+
+#endif
+
+uint64_t _expr_tree_meta::atom_hash(const Atom &atom)
+{
+	uint64_t bits;
+	if (atom.is <Integer> ())
+		bits = atom.as <Integer> ();
+	else if (atom.is <InternedReal> ())
+		bits = atom.as <InternedReal> ().index;
+	else
+		bits = atom.as <Symbol> ().id;
+
+	return _mix(bits * 4 + atom.index(), OXIDIUS_HASH_SEED);
+}
+
+uint64_t _expr_tree_meta::op_hash(Operation op)
+{
+	return _mix(op + 0x9e3779b97f4a7c15, OXIDIUS_HASH_SEED);
+}
+
+uint64_t _expr_tree_meta::combine(uint64_t seed, uint64_t operand)
+{
+	return _mix(seed, operand);
+}
+
+void ETN::refresh()
+{
+	if (is <_expr_tree_atom> ()) {
+		const Atom &atom = as <_expr_tree_atom> ().atom;
+
+		uint64_t hash = _expr_tree_meta::atom_hash(atom);
+
+		meta = _expr_tree_meta {
+			.hash = hash,
+			.ac = hash,
+			.symbols = atom.is <Symbol> () ? _expr_tree_meta::symbol_bit(atom.as <Symbol> ()) : 0,
+			.size = 1,
+			.depth = 1
+		};
+
+		return;
+	}
+
+	const auto &tree = as <_expr_tree_op> ();
+
+	uint64_t hash = _expr_tree_meta::op_hash(tree.op);
+	uint64_t ac = is_ac(tree.op) ? 0 : hash;
+	uint64_t symbols = 0;
+	uint32_t size = 1;
+	uint32_t depth = 0;
+
+	ETN_ref head = tree.down;
+	while (head) {
+		hash = _expr_tree_meta::combine(hash, head->meta.hash);
+
+		if (!is_ac(tree.op))
+			ac = _expr_tree_meta::combine(ac, head->ac_hash());
+		else if (head->is <_expr_tree_op> () && head->as <_expr_tree_op> ().op == tree.op)
+			ac += head->meta.ac;
+		else
+			ac += _expr_tree_meta::combine(head->ac_hash(), 0);
+
+		symbols |= head->meta.symbols;
+		size += head->meta.size;
+		depth = std::max(depth, head->meta.depth);
+		head = head->next();
+	}
+
+	meta = _expr_tree_meta {
+		.hash = hash,
+		.ac = ac,
+		.symbols = symbols,
+		.size = size,
+		.depth = depth + 1
+	};
+}
+
+uint64_t ETN::ac_hash() const
+{
+	if (is <_expr_tree_op> ()) {
+		Operation op = as <_expr_tree_op> ().op;
+		if (is_ac(op))
+			return _expr_tree_meta::combine(_expr_tree_meta::op_hash(op), meta.ac);
+	}
+
+	return meta.ac;
+}
+
 std::vector <Symbol> ETN::symbols() const
 {
 	std::vector <Symbol> symbols;
-	std::queue <const ETN *> refs;
+	if (!meta.symbols)
+		return symbols;
+
+	// Bits already seen; a symbol whose bit is
+	// clear cannot be a duplicate
+	uint64_t seen = 0;
 
-	refs.push(this);
+	std::vector <const ETN *> refs { this };
 	while (refs.size()) {
-		auto e = refs.front();
-		refs.pop();
+		auto e = refs.back();
+		refs.pop_back();
 
 		if (e->is <_expr_tree_op> ()) {
-			auto etop = e->as <_expr_tree_op> ();
+			// Pushed in reverse, to visit from left to right
+			size_t mark = refs.size();
 
-			ETN_ref head = etop.down;
+			ETN_ref head = e->as <_expr_tree_op> ().down;
 			while (head) {
-				refs.push(head);
+				if (head->meta.symbols)
+					refs.push_back(head);
 				head = head->next();
 			}
+
+			std::reverse(refs.begin() + mark, refs.end());
 		} else {
-			auto eta = e->as <_expr_tree_atom> ().atom;
-			if (eta.is <Symbol> ())
-				symbols.push_back(eta.as <Symbol> ());
+			Symbol sym = e->as <_expr_tree_atom> ().atom.as <Symbol> ();
+
+			uint64_t bit = _expr_tree_meta::symbol_bit(sym);
+			if ((seen & bit) && std::find(symbols.begin(), symbols.end(), sym) != symbols.end())
+				continue;
+
+			seen |= bit;
+			symbols.push_back(sym);
 		}
 	}
 
@@ -40,9 +40,13 @@ struct _fmt_token_dispatcher {
 		ref += fmt::format("R:{}", r);
 	}
 
+	void operator()(InternedReal r) {
+		ref += fmt::format("R:{}", r.value());
+	}
+
 	void operator()(Symbol symbol) {
 		ref += "sym:";
-		ref += symbol;
+		ref += symbol.str();
 	}
 
 	void operator()(Operation op) {
@@ -103,7 +107,7 @@ struct _fmt_token_dispatcher {
 	}
 
 	void operator()(Comparator cmp) {
-		ref += "<cmp:'" + cmp.s + "'>";
+		ref += "<cmp:'" + cmp.s.str() + "'>";
 	}
 
 	void operator()(LiteralString literal) {
@@ -116,6 +120,11 @@ struct _fmt_token_dispatcher {
 	}
 };
 
+std::string format_as(const Symbol &sym)
+{
+	return sym.str();
+}
+
 std::string format_as(const Atom &atom)
 {
 	std::string result;
@@ -156,8 +165,12 @@ struct _fmt_atom_dispatcher {
 		ref += fmt::format("{}", r);
 	}
 
+	void operator()(InternedReal r) {
+		ref += fmt::format("{}", r.value());
+	}
+
 	void operator()(Symbol symbol) {
-		ref += symbol;
+		ref += symbol.str();
 	}
 
 	void operator()(Operation op) {
@@ -214,7 +227,7 @@ std::string format_as(const Signature &sig)
 	std::string result;
 
 	for (auto it = sig.begin(); it != sig.end(); it++) {
-		result += it->first + " ∈ " + format_as(it->second);
+		result += it->first.str() + " ∈ " + format_as(it->second);
 		if (std::next(it) != sig.end())
 			result += ", ";
 	}
@@ -237,12 +250,16 @@ std::string _etn_to_string(const ETN *etn, bool first = true)
 		if (!first)
 			result += "(";
 
-		ETN *a = tree.down;
-		ETN *b = a->next();
+		// Operations may be n-ary (e.g. in canonical form)
+		for (ETN *head = tree.down; head; head = head->next()) {
+			if (head != tree.down) {
+				result += " ";
+				ftd(tree.op);
+				result += " ";
+			}
 
-		result += _etn_to_string(a, false) + " ";
-		ftd(tree.op);
-		result += " " + _etn_to_string(b, false);
+			result += _etn_to_string(head, false);
+		}
 
 		if (!first)
 			result += ")";
@@ -258,6 +275,39 @@ std::string format_as(const Expression &expr)
 	return _etn_to_string(expr.etn);
 }
 
+std::string _linear_to_string(const LinearExpression &lexpr, size_t i, bool first = true)
+{
+	std::string result;
+
+	_fmt_atom_dispatcher ftd(result);
+	if (!lexpr.is_op(i)) {
+		std::visit(ftd, lexpr.atom(i));
+	} else {
+		if (!first)
+			result += "(";
+
+		lexpr.forall_operands(i, [&](size_t j) {
+			if (j != i + 1) {
+				result += " ";
+				ftd(lexpr.op(i));
+				result += " ";
+			}
+
+			result += _linear_to_string(lexpr, j, false);
+		});
+
+		if (!first)
+			result += ")";
+	}
+
+	return result;
+}
+
+std::string format_as(const LinearExpression &lexpr)
+{
+	return _linear_to_string(lexpr, 0);
+}
+
 std::string format_as(const Statement &stmt)
 {
 	// TODO: assuming eq
@@ -265,7 +315,7 @@ std::string format_as(const Statement &stmt)
 	// 	+ " = " + _etn_to_string(stmt.rhs.etn)
 	// 	+ " " + format_as(stmt.signature);
 	return _etn_to_string(stmt.lhs.etn)
-		+ " " + stmt.cmp.s + " "
+		+ " " + stmt.cmp.s.str() + " "
 		+ _etn_to_string(stmt.rhs.etn);
 }
 
@@ -275,7 +325,7 @@ std::string format_as(const UnresolvedValue &v)
 		return format_as(v.as <Statement> ());
 
 	if (v.is <Symbol> ())
-		return v.as <Symbol> ();
+		return v.as <Symbol> ().str();
 
 	if (v.is <LiteralString> ())
 		return "\"" + v.as <LiteralString> () + "\"";
@@ -307,7 +357,7 @@ std::string format_as(const UnresolvedValue &v)
 		auto result = argument.result;
 		std::string rstring;
 		if (result.is <Symbol> ())
-			rstring = result.as <Symbol> ();
+			rstring = result.as <Symbol> ().str();
 		else
 			rstring = format_as(result.as <Statement> ());
 		return format_as(argument.predicates) + " => " + rstring;
@@ -365,7 +415,7 @@ std::string format_as(const Value &v)
 }
 
 // Type string
-const Symbol type_string(const UnresolvedValue &v)
+const std::string type_string(const UnresolvedValue &v)
 {
 	// TODO: table with # of types (auto_variant methods)
 	if (v.is <Statement> ())
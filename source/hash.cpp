@@ -1,12 +1,11 @@
+
 #include "include/hash.hpp"
 #include "include/format.hpp"
 
+// Cached in each node, see _expr_tree_meta
 hash_type quick_hash(const ETN_ref &tree)
 {
-	hash_type h0 = hhash <0> (tree);
-	hash_type h1 = hhash <1> (tree);
-	hash_type h2 = hhash <2> (tree);
-	return std::rotr(h1, h0 % 7) | std::rotl(h2, h0 % 11);
+	return tree->meta.hash;
 }
 
 hash_type quick_hash(const Expression &expr)
@@ -14,23 +13,234 @@ hash_type quick_hash(const Expression &expr)
 	return quick_hash(expr.etn);
 }
 
-// Displaying tables
-void list_table(const ExprTable_L1 &table)
+// Same Merkle hash as for trees
+static hash_type _merkle(const LinearExpression &lexpr, size_t i)
 {
-	fmt::println("L1 table:");
+	if (!lexpr.is_op(i))
+		return _expr_tree_meta::atom_hash(lexpr.atom(i));
+
+	hash_type seed = _expr_tree_meta::op_hash(lexpr.op(i));
+	lexpr.forall_operands(i, [&](size_t j) {
+		seed = _expr_tree_meta::combine(seed, _merkle(lexpr, j));
+	});
+
+	return seed;
+}
+
+hash_type quick_hash(const LinearExpression &lexpr)
+{
+	return _merkle(lexpr, 0);
+}
+
+// Control byte index
+_control_index::_control_index(size_t capacity)
+{
+	if (!capacity)
+		return;
+
+	capacity = std::bit_ceil(std::max(capacity, group_width));
+	control.resize(capacity, control_empty);
+	slots.resize(capacity);
+}
+
+size_t _control_index::insert(const _table_slot &slot)
+{
+	size_t mask = groups() - 1;
+	size_t g = home(slot.hash) & mask;
+
+	// Always terminates, since the load is bounded
+	for (size_t probes = 1; ; probes++, g = (g + 1) & mask) {
+		const control_byte *group = &control[g * group_width];
 
-	size_t M = table.table_size;
-	size_t N = table.vector_size;
+		if (uint32_t m = _group_match(group, control_empty)) {
+			size_t pos = g * group_width + std::countr_zero(m);
+
+			control[pos] = tag(slot.hash);
+			slots[pos] = slot;
+			count++;
+
+			return probes;
+		}
+	}
+}
 
-	double load = 0;
-	for (size_t i = 0; i < M; i++) {
-		for (size_t j = 0; j < N; j++) {
-			if (table.valid[i * N + j]) {
-				fmt::println("  {}", table.data[i][j]);
-				load++;
+// Expression table
+ExpressionTable::ExpressionTable(node_store *s, size_t capacity)
+		: index(capacity), store(s) {}
+
+std::optional <size_t> ExpressionTable::find(const Expression &expr)
+{
+	hash_type h = key(expr);
+
+	// Slots of truncated entries may remain
+	auto pred = [&](const _table_slot &slot) {
+		return !_stale(slot) && same(entries[slot.entry], expr);
+	};
+
+	size_t probes = 0;
+
+	std::optional <size_t> result;
+	if (size_t pos = index.find(h, pred, probes); pos != _control_index::npos)
+		result = index.slots[pos].entry;
+	else if (size_t pos = previous.find(h, pred, probes); pos != _control_index::npos)
+		result = previous.slots[pos].entry;
+
+	stats.lookups++;
+	stats.hits += result.has_value();
+	stats.probes += probes;
+	stats.max_probe = std::max(stats.max_probe, probes);
+
+	return result;
+}
+
+bool ExpressionTable::push(const Expression &expr)
+{
+	_migrate(rehash_step);
+
+	if (find(expr))
+		return false;
+
+	// Entries yet to be migrated count towards the load
+	if (index.full(pending + 1))
+		_grow();
+
+	uint32_t e = entries.size();
+	entries.push_back(expr);
+	generations.push_back(generation);
+
+	size_t probes = index.insert({ key(expr), e, generation });
+	stats.max_probe = std::max(stats.max_probe, probes);
+
+	return true;
+}
+
+void ExpressionTable::rollback(const table_epoch &epoch)
+{
+	_truncate(epoch.entries);
+	smm.arena.rollback(epoch.nodes);
+}
+
+void ExpressionTable::_truncate(size_t size)
+{
+	if (size < entries.size()) {
+		entries.resize(size);
+		generations.resize(size);
+		generation++;
+	}
+}
+
+// Slot of a truncated entry, or of one whose
+// index has since been reused by another entry
+bool ExpressionTable::_stale(const _table_slot &slot) const
+{
+	return slot.entry >= entries.size()
+		|| generations[slot.entry] != slot.generation;
+}
+
+void ExpressionTable::_grow()
+{
+	// Finish any previous migration first
+	_migrate(previous.capacity());
+
+	// Sized by live entries, which bound the live slots;
+	// stale ones are dropped while migrating, so that if
+	// most slots are stale (after rollbacks), the index is
+	// rebuilt at the same capacity, or a smaller one
+	previous = std::move(index);
+	index = _control_index(2 * (entries.size() + 1));
+	migrated = 0;
+	pending = previous.count;
+
+	stats.resizes++;
+}
+
+void ExpressionTable::_migrate(size_t n)
+{
+	if (previous.slots.empty())
+		return;
+
+	for (; n && migrated < previous.capacity(); n--, migrated++) {
+		if (previous.control[migrated] < 0)
+			continue;
+
+		const _table_slot &slot = previous.slots[migrated];
+		if (!_stale(slot))
+			index.insert(slot);
+
+		pending--;
+	}
+
+	if (migrated == previous.capacity()) {
+		previous = _control_index();
+		migrated = 0;
+	}
+}
+
+// Concurrent expression table
+ConcurrentExpressionTable::ConcurrentExpressionTable(size_t capacity_, size_t workers)
+		: slots(new std::atomic <_concurrent_entry *> [std::bit_ceil(capacity_)]),
+		capacity(std::bit_ceil(capacity_)),
+		unique(0),
+		arenas(workers)
+{
+	for (size_t i = 0; i < capacity; i++)
+		slots[i].store(nullptr, std::memory_order_relaxed);
+}
+
+ConcurrentExpressionTable::~ConcurrentExpressionTable()
+{
+	for (size_t i = 0; i < capacity; i++)
+		delete slots[i].load(std::memory_order_relaxed);
+}
+
+std::optional <ConcurrentExpressionTable::result> ConcurrentExpressionTable::push(const Expression &expr)
+{
+	hash_type h = quick_hash(expr);
+
+	// Built on reaching the first empty slot, and
+	// kept for the next one if that slot is taken
+	std::unique_ptr <_concurrent_entry> entry;
+
+	size_t mask = capacity - 1;
+	size_t pos = h & mask;
+	for (size_t i = 0; i < capacity; i++, pos = (pos + 1) & mask) {
+		_concurrent_entry *current = slots[pos].load(std::memory_order_acquire);
+
+		if (!current) {
+			if (!entry)
+				entry.reset(new _concurrent_entry { h, expr });
+
+			if (slots[pos].compare_exchange_strong(current, entry.get(),
+					std::memory_order_acq_rel, std::memory_order_acquire)) {
+				entry.release();
+				unique.fetch_add(1, std::memory_order_relaxed);
+				return result { pos, true };
 			}
+
+			// Taken in the meantime, possibly by
+			// the same expression; current is the
+			// entry that took it
 		}
+
+		if (current->hash == h && equal(current->expr, expr))
+			return result { pos, false };
 	}
 
-	fmt::println("  load: {:03.2f}%", 100.0 * load/(M * N));
+	return std::nullopt;
+}
+
+// Displaying tables
+void list_table(const ExprTable_L1 &table)
+{
+	fmt::println("L1 table:");
+
+	for (const auto &expr : table.entries)
+		fmt::println("  {}", expr);
+
+	const table_stats &stats = table.stats;
+
+	fmt::println("  load: {:03.2f}% ({}/{})", 100.0 * table.load(), table.size(), table.capacity());
+	fmt::println("  probes: {:.2f} avg, {} max", stats.lookups ? double(stats.probes) / stats.lookups : 0.0, stats.max_probe);
+	fmt::println("  resizes: {}", stats.resizes);
+	fmt::println("  hits: {:03.2f}%", stats.lookups ? 100.0 * stats.hits / stats.lookups : 0.0);
 }
@@ -0,0 +1,230 @@
+#include <algorithm>
+
+#include "include/index.hpp"
+
+_dtree_key _dtree_key::from(const ETN_ref &etn)
+{
+	if (etn->is <_expr_tree_op> ()) {
+		uint32_t arity = 0;
+		etn->forall_operands([&](const ETN_ref &) { arity++; });
+
+		return {
+			.kind = op,
+			.arity = arity,
+			.value = (uint64_t) etn->as <_expr_tree_op> ().op
+		};
+	}
+
+	const Atom &atom = etn->as <_expr_tree_atom> ().atom;
+	if (atom.is <Integer> ())
+		return { .kind = integer, .arity = 0, .value = (uint64_t) atom.as <Integer> () };
+	if (atom.is <InternedReal> ())
+		return { .kind = real, .arity = 0, .value = atom.as <InternedReal> ().index };
+
+	return { .kind = symbol, .arity = 0, .value = atom.as <Symbol> ().id };
+}
+
+uint32_t DiscriminationTree::_descend(uint32_t n, const ETN_ref &etn, std::vector <Symbol> &seen, bool extend)
+{
+	_dtree_key key = _dtree_key::from(etn);
+
+	if (key.kind == _dtree_key::symbol) {
+		Symbol sym = Symbol::from(key.value);
+
+		// Later occurrences are keyed by slot
+		auto it = std::find(seen.begin(), seen.end(), sym);
+		if (it != seen.end()) {
+			key = {
+				.kind = _dtree_key::variable,
+				.arity = 0,
+				.value = uint64_t(it - seen.begin())
+			};
+		} else {
+			seen.push_back(sym);
+			if (!nodes[n].wildcard && extend) {
+				nodes[n].wildcard = nodes.size();
+				nodes.emplace_back();
+			}
+
+			return nodes[n].wildcard;
+		}
+	}
+
+	uint32_t next = 0;
+	for (const auto &[k, child] : nodes[n].edges) {
+		if (k == key) {
+			next = child;
+			break;
+		}
+	}
+
+	if (!next) {
+		if (!extend)
+			return 0;
+
+		next = nodes.size();
+		nodes[n].edges.emplace_back(key, next);
+		nodes.emplace_back();
+	}
+
+	ETN_ref head = etn->is <_expr_tree_op> () ? etn->as <_expr_tree_op> ().down : nullptr;
+	while (head && next) {
+		next = _descend(next, head, seen, extend);
+		head = head->next();
+	}
+
+	return next;
+}
+
+size_t DiscriminationTree::insert(const Rule &rule)
+{
+	uint32_t id = rules.size();
+	rules.push_back(rule);
+	alive.push_back(true);
+	live++;
+
+	Rule &inserted = rules.back();
+	inserted.symbols.clear();
+	inserted.program = RewriteProgram::compile(rule.from, rule.to);
+
+	uint32_t leaf = _descend(0, rule.from.etn, inserted.symbols, true);
+	nodes[leaf].rules.push_back(id);
+	return id;
+}
+
+void DiscriminationTree::insert(const Statement &stmt, const Symbol &owner)
+{
+	insert(Rule { stmt.lhs, stmt.rhs, owner });
+	insert(Rule { stmt.rhs, stmt.lhs, owner });
+}
+
+void DiscriminationTree::insert(const Argument &argument, const Symbol &owner)
+{
+	const Statement &stmt = argument.result;
+	insert(Rule { stmt.lhs, stmt.rhs, owner, argument.predicates });
+	insert(Rule { stmt.rhs, stmt.lhs, owner, argument.predicates });
+}
+
+void DiscriminationTree::remove(size_t id)
+{
+	if (!alive[id])
+		return;
+
+	alive[id] = false;
+	live--;
+
+	// Emptied paths are left in place
+	std::vector <Symbol> seen;
+	uint32_t leaf = _descend(0, rules[id].from.etn, seen, false);
+	std::erase(nodes[leaf].rules, id);
+}
+
+void DiscriminationTree::remove(const Symbol &owner)
+{
+	for (size_t i = 0; i < rules.size(); i++) {
+		if (rules[i].owner == owner)
+			remove(i);
+	}
+}
+
+// The pending stack holds the remaining subterms of the term, in
+// preorder with the next one on top, and the bound stack holds
+// the subterm for each slot; both are restored on return
+template <typename F>
+void DiscriminationTree::_traverse(uint32_t n, std::vector <ETN_ref> &pending, std::vector <ETN_ref> &bound, F &&leaf) const
+{
+	const _dtree_node &node = nodes[n];
+	if (pending.empty()) {
+		if (!node.rules.empty())
+			leaf(node, bound);
+
+		return;
+	}
+
+	ETN_ref etn = pending.back();
+	pending.pop_back();
+
+	if (node.wildcard) {
+		bound.push_back(etn);
+		_traverse(node.wildcard, pending, bound, leaf);
+		bound.pop_back();
+	}
+
+	_dtree_key key = _dtree_key::from(etn);
+	for (const auto &[k, child] : node.edges) {
+		if (k.kind == _dtree_key::variable) {
+			if (equal(bound[k.value], etn))
+				_traverse(child, pending, bound, leaf);
+
+			continue;
+		}
+
+		if (k != key)
+			continue;
+
+		size_t mark = pending.size();
+		etn->forall_operands([&](const ETN_ref &head) {
+			pending.push_back(head);
+		});
+
+		std::reverse(pending.begin() + mark, pending.end());
+		_traverse(child, pending, bound, leaf);
+		pending.resize(mark);
+	}
+
+	pending.push_back(etn);
+}
+
+void DiscriminationTree::retrieve(const ETN_ref &etn, std::vector <uint32_t> &result) const
+{
+	size_t begin = result.size();
+
+	std::vector <ETN_ref> pending { etn };
+	std::vector <ETN_ref> bound;
+	_traverse(0, pending, bound,
+		[&](const _dtree_node &node, const std::vector <ETN_ref> &) {
+			result.insert(result.end(), node.rules.begin(), node.rules.end());
+		}
+	);
+
+	std::sort(result.begin() + begin, result.end());
+}
+
+std::vector <uint32_t> DiscriminationTree::retrieve(const Expression &expr) const
+{
+	std::vector <uint32_t> result;
+	retrieve(expr.etn, result);
+	return result;
+}
+
+void DiscriminationTree::match(const ETN_ref &etn, std::vector <RuleMatch> &result) const
+{
+	size_t begin = result.size();
+
+	std::vector <ETN_ref> pending { etn };
+	std::vector <ETN_ref> bound;
+	_traverse(0, pending, bound,
+		[&](const _dtree_node &node, const std::vector <ETN_ref> &bound) {
+			for (uint32_t id : node.rules) {
+				const Rule &rule = rules[id];
+
+				RuleMatch &m = result.emplace_back(id);
+				for (size_t i = 0; i < rule.symbols.size(); i++)
+					m.sub.bind(rule.symbols[i], bound[i]);
+			}
+		}
+	);
+
+	std::sort(result.begin() + begin, result.end(),
+		[](const RuleMatch &A, const RuleMatch &B) {
+			return A.rule < B.rule;
+		}
+	);
+}
+
+std::vector <RuleMatch> DiscriminationTree::match(const Expression &expr) const
+{
+	std::vector <RuleMatch> result;
+	match(expr.etn, result);
+	return result;
+}
@@ -144,8 +144,8 @@ ParseResult <Token> lex_keyword(const std::string &s, size_t pos, const std::str
 template <typename T, T value>
 ParseResult <Token> lex_keyword(const std::string &s, size_t pos, const std::string &kw)
 {
-	if (lex_keyword <T> (s, pos, kw))
-		return ParseResult <Token> ::ok(T(value), pos);
+	if (auto result = lex_keyword <T> (s, pos, kw))
+		return ParseResult <Token> ::ok(T(value), result.next);
 
 	return ParseResult <Token> ::fail();
 }
@@ -176,7 +176,7 @@ ParseResult <Comparator> lex_comparator(const std::string &s, size_t pos)
 
 	auto list = Comparator::list;
 	auto cmp = [&](const Comparator &A, const Comparator &B) {
-		return A.s.size() > B.s.size();
+		return A.s.str().size() > B.s.str().size();
 	};
 
 	// fmt::println("CMP SIZE: {}", list.size());
@@ -185,7 +185,7 @@ ParseResult <Comparator> lex_comparator(const std::string &s, size_t pos)
 
 	for (auto cmp : list) {
 		// fmt::println("CMP: {}", cmp);
-		std::string c = cmp.s;
+		const std::string &c = cmp.s.str();
 
 		bool fail = false;
 		size_t p = pos;
@@ -203,13 +203,15 @@ ParseResult <Comparator> lex_comparator(const std::string &s, size_t pos)
 	return ParseResult <Comparator> ::fail();
 }
 
-ParseResult <Symbol> lex_symbol(const std::string &s, size_t pos)
+// Lexes a single (possibly subscripted) letter; consecutive
+// letters are combined into one symbol by the caller
+ParseResult <std::string> lex_symbol(const std::string &s, size_t pos)
 {
 	if (!std::isalpha(s[pos])) {
-		return ParseResult <Symbol> ::fail();
+		return ParseResult <std::string> ::fail();
 	}
 
-	Symbol result;
+	std::string result;
 	result += s[pos++];
 
 	if (s[pos] == '_') {
@@ -220,7 +222,7 @@ ParseResult <Symbol> lex_symbol(const std::string &s, size_t pos)
 		// TODO: check for braces, e.g. f_{new}
 	}
 
-	return ParseResult <Symbol> ::ok(result, pos);
+	return ParseResult <std::string> ::ok(result, pos);
 }
 
 ParseResult <Token> lex_special(const std::string &s, size_t pos)
@@ -275,25 +277,14 @@ ParseResult <Token> lex_special(const std::string &s, size_t pos)
 	return ParseResult <Token> ::fail();
 }
 
-// Refining tokens; combining symbols outside symbolic blocks and removing spaces
+// Refining tokens; removing spaces
 std::vector <Token> refine(const std::vector <Token> &tokens)
 {
 	std::vector <Token> result;
 
-	size_t i = 0;
-	while (i < tokens.size()) {
-		if (tokens[i].is <Space> ()) {
-			i++;
-		} else if (tokens[i].is <Symbol> ()) {
-			Symbol s;
-			while (tokens[i].is <Symbol> ())
-				s += tokens[i++].as <Symbol> ();
-
-			result.push_back(s);
-		} else {
-			result.push_back(tokens[i]);
-			i++;
-		}
+	for (const auto &t : tokens) {
+		if (!t.is <Space> ())
+			result.push_back(t);
 	}
 
 	return result;
@@ -305,11 +296,24 @@ std::vector <Token> lex(const std::string &s)
 {
 	std::vector <Token> result;
 
+	// Letters are accumulated and only
+	// interned once the symbol is complete
+	std::string name;
+
+	auto emit = [&](const Token &t) {
+		if (name.size()) {
+			result.push_back(Symbol(name));
+			name.clear();
+		}
+
+		result.push_back(t);
+	};
+
 	size_t pos = 0;
 	while (pos < s.length()) {
 		char c = s[pos];
 		if (std::isspace(c)) {
-			result.push_back(Space());
+			emit(Space());
 			while (std::isspace(s[pos])) {
 				pos++;
 			}
@@ -317,16 +321,16 @@ std::vector <Token> lex(const std::string &s)
 			while (s[pos] != '\n')
 				pos++;
 		} else if (auto op_result = lex_operation(s, pos)) {
-			result.push_back(op_result.value);
+			emit(op_result.value);
 			pos = op_result.next;
 		} else if (auto special_result = lex_special(s, pos)) {
-			result.push_back(special_result.value);
+			emit(special_result.value);
 			pos = special_result.next;
 		} else if (auto cmp_result = lex_comparator(s, pos)) {
-			result.push_back(cmp_result.value);
+			emit(cmp_result.value);
 			pos = cmp_result.next;
 		} else if (auto keyword_result = lex_keyword(s, pos)) {
-			result.push_back(keyword_result.value);
+			emit(keyword_result.value);
 			pos = keyword_result.next;
 		} else if (std::isdigit(c)) {
 			auto real_result = lex_real(s, pos);
@@ -335,17 +339,17 @@ std::vector <Token> lex(const std::string &s)
 			if (!real_result.extra) {
 				// Decimal was not encountered
 				auto integer_result = lex_integer(s, pos);
-				result.push_back(integer_result.value);
+				emit(integer_result.value);
 				pos = integer_result.next;
 			} else {
-				result.push_back(real_result.value);
+				emit(real_result.value);
 				pos = real_result.next;
 			}
 		} else if (std::isalpha(c)) {
 			auto symbol_result = lex_symbol(s, pos);
 			assert(symbol_result);
 
-			result.push_back(symbol_result.value);
+			name += symbol_result.value;
 			pos = symbol_result.next;
 		} else {
 			fprintf(stderr, "encountered unexpected character '%c'\n", c);
@@ -353,6 +357,9 @@ std::vector <Token> lex(const std::string &s)
 		}
 	}
 
+	if (name.size())
+		result.push_back(Symbol(name));
+
 	// fmt::println("tokens:");
 	// for (auto t : result)
 	// 	fmt::print("{} ", t);
@@ -0,0 +1,256 @@
+#include <algorithm>
+#include <unordered_map>
+
+#include "include/linear.hpp"
+#include "include/format.hpp"
+
+// Construction
+struct _linearizer {
+	LinearExpression &result;
+
+	void atom(const Atom &atom) {
+		_linear_node node;
+		node.op = none;
+		node.arity = 0;
+		node.size = 1;
+
+		if (atom.is <Integer> ()) {
+			node.tag = _linear_tag::integer;
+			node.integer = atom.as <Integer> ();
+		} else if (atom.is <InternedReal> ()) {
+			node.tag = _linear_tag::real;
+			node.integer = 0;
+			node.real = atom.as <InternedReal> ().index;
+		} else {
+			node.tag = _linear_tag::symbol;
+			node.integer = 0;
+			node.symbol = atom.as <Symbol> ().id;
+		}
+
+		result.nodes.push_back(node);
+	}
+
+	void operator()(const ETN_ref &ref) {
+		if (ref->is <_expr_tree_atom> ())
+			return atom(ref->as <_expr_tree_atom> ().atom);
+
+		auto tree = ref->as <_expr_tree_op> ();
+
+		size_t i = result.nodes.size();
+
+		_linear_node node;
+		node.tag = _linear_tag::op;
+		node.op = tree.op;
+		node.arity = 0;
+		node.size = 0;
+		node.integer = 0;
+		node.dom = tree.dom;
+
+		result.nodes.push_back(node);
+
+		ETN_ref head = tree.down;
+		while (head) {
+			this->operator()(head);
+			result.nodes[i].arity++;
+			head = head->next();
+		}
+
+		result.nodes[i].size = result.nodes.size() - i;
+	}
+};
+
+LinearExpression LinearExpression::from(const ETN_ref &ref)
+{
+	LinearExpression result;
+
+	_linearizer linearizer { result };
+	linearizer(ref);
+
+	return result;
+}
+
+LinearExpression linearize(const Expression &expr)
+{
+	return LinearExpression::from(expr.etn);
+}
+
+// Queries
+Atom LinearExpression::atom(size_t i) const
+{
+	const _linear_node &node = nodes[i];
+	switch (node.tag) {
+	case _linear_tag::integer:
+		return node.integer;
+	case _linear_tag::real:
+		return InternedReal::from(node.real);
+	case _linear_tag::symbol:
+		return Symbol::from(node.symbol);
+	default:
+		break;
+	}
+
+	fmt::println("linear node @{} is not an atom", i);
+	return Integer(0);
+}
+
+// Distinct symbols, by first occurrence (as for trees)
+std::vector <Symbol> LinearExpression::symbols() const
+{
+	std::vector <Symbol> result;
+
+	// Bits already seen, as in ETN::symbols
+	uint64_t seen = 0;
+
+	for (const auto &node : nodes) {
+		if (node.tag != _linear_tag::symbol)
+			continue;
+
+		Symbol sym = Symbol::from(node.symbol);
+
+		uint64_t bit = _expr_tree_meta::symbol_bit(sym);
+		if ((seen & bit) && std::find(result.begin(), result.end(), sym) != result.end())
+			continue;
+
+		seen |= bit;
+		result.push_back(sym);
+	}
+
+	return result;
+}
+
+// Conversion back to trees
+template <typename A, typename M>
+static ETN_ref _tree(const LinearExpression &lexpr, size_t i, A &&make_atom, M &&make_op)
+{
+	if (!lexpr.is_op(i))
+		return make_atom(_expr_tree_atom(lexpr.atom(i)));
+
+	ETN_ref netn = make_op(_expr_tree_op {
+		.op = lexpr.op(i),
+		.dom = lexpr.dom(i),
+		.down = nullptr,
+		.next = nullptr
+	});
+
+	ETN_ref p = nullptr;
+	lexpr.forall_operands(i, [&](size_t j) {
+		ETN_ref q = _tree(lexpr, j, make_atom, make_op);
+		if (p)
+			p->next() = q;
+		else
+			netn->as <_expr_tree_op> ().down = q;
+
+		p = q;
+	});
+
+	netn->refresh();
+	return netn;
+}
+
+ETN_ref LinearExpression::tree(size_t i) const
+{
+	auto make = [](const auto &node) { return new ETN(node); };
+	return _tree(*this, i, make, make);
+}
+
+ETN_ref LinearExpression::tree(scoped_memory_manager &smm, size_t i) const
+{
+	auto make = [&](const auto &node) { return smm.make(node); };
+	return _tree(*this, i, make, make);
+}
+
+// Comparison; subtrees are compared with a single linear scan
+static bool _equal_atom(const _linear_node &a, const _linear_node &b)
+{
+	switch (a.tag) {
+	case _linear_tag::integer:
+		return a.integer == b.integer;
+	case _linear_tag::real:
+		return a.real == b.real;
+	case _linear_tag::symbol:
+		return a.symbol == b.symbol;
+	default:
+		break;
+	}
+
+	return a.op == b.op && a.arity == b.arity;
+}
+
+bool equal(const LinearExpression &A, size_t i, const LinearExpression &B, size_t j)
+{
+	size_t n = A.nodes[i].size;
+	if (n != B.nodes[j].size)
+		return false;
+
+	for (size_t k = 0; k < n; k++) {
+		const _linear_node &a = A.nodes[i + k];
+		const _linear_node &b = B.nodes[j + k];
+
+		// Sizes must agree for the shapes to agree
+		if (a.tag != b.tag || a.size != b.size)
+			return false;
+
+		if (!_equal_atom(a, b))
+			return false;
+	}
+
+	return true;
+}
+
+bool equal(const LinearExpression &A, const LinearExpression &B)
+{
+	return equal(A, 0, B, 0);
+}
+
+// Matching; the pattern is scanned once, skipping
+// over the victim subtrees bound to its symbols
+std::optional <Substitution> match(const LinearExpression &source, const LinearExpression &victim)
+{
+	Substitution sub;
+
+	// Bound subtree of the victim for each pattern symbol
+	std::unordered_map <uint32_t, size_t> bound;
+
+	auto drop = [&]() {
+		scoped_memory_manager smm;
+		smm.drop(sub);
+		return std::nullopt;
+	};
+
+	size_t i = 0;
+	size_t j = 0;
+	while (i < source.nodes.size()) {
+		const _linear_node &s = source.nodes[i];
+		const _linear_node &v = victim.nodes[j];
+
+		if (s.tag == _linear_tag::symbol) {
+			auto it = bound.find(s.symbol);
+			if (it == bound.end()) {
+				bound.emplace(s.symbol, j);
+
+				sub.bind(Symbol::from(s.symbol), victim.tree(j));
+			} else if (!equal(victim, it->second, victim, j)) {
+				return drop();
+			}
+
+			i++;
+			j = victim.skip(j);
+			continue;
+		}
+
+		if (s.tag != v.tag)
+			return drop();
+
+		if (s.tag == _linear_tag::op) {
+			if (s.op != v.op || s.arity != v.arity)
+				return drop();
+		} else if (!_equal_atom(s, v)) {
+			return drop();
+		}
+
+		i++;
+		j++;
+	}
+
+	return sub;
+}
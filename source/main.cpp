@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <iostream>
 #include <type_traits>
 #include <functional>
@@ -8,10 +9,12 @@
 #include <fmt/core.h>
 
 #include "include/action.hpp"
+#include "include/egraph.hpp"
 #include "include/formalism.hpp"
 #include "include/format.hpp"
 #include "include/function.hpp"
 #include "include/hash.hpp"
+#include "include/index.hpp"
 #include "include/lex.hpp"
 #include "include/match.hpp"
 #include "include/memory.hpp"
@@ -35,110 +38,496 @@
 // axiom := $(a + b = c) => $(a = c - b)
 // TODO: # for comments
 
-void _transform(ExprTable_L1 &table, const Expression &expr, const Statement &stmt, push_marker &pm, bool exhaustive, int depth)
+// Rules applied by a transform, indexed so that each subterm
+// is matched against all of them in one traversal
+struct _transform_rules {
+	const DiscriminationTree &tree;
+
+	// Modulo AC, such rules never give anything novel
+	std::vector <bool> ac_identity;
+
+	_transform_rules(const DiscriminationTree &tree) : tree(tree) {
+		for (const Rule &rule : tree.rules)
+			ac_identity.push_back(ac_equal(rule.from, rule.to));
+	}
+
+	// Conclusions of arguments only hold under their
+	// premises, which a rewrite cannot discharge
+	bool applicable(uint32_t id) const {
+		return tree.alive[id] && tree.rules[id].premises.empty();
+	}
+};
+
+// Order in which a transform expands the expressions it finds
+enum Strategy {
+	breadth_first,
+	depth_first,
+
+	// Depth first, under a bound on rewrites that is
+	// raised by one each round, until a round finds
+	// nothing new
+	iterative_deepening,
+
+	// Smallest expressions first
+	best_first
+};
+
+// Strategy by name, as given to the strategy option
+static std::optional <Strategy> _strategy(const std::string &name)
 {
-	if (depth == 0)
-		return;
+	static const std::unordered_map <std::string, Strategy> names {
+		{ "breadth_first", breadth_first },
+		{ "depth_first", depth_first },
+		{ "iterative_deepening", iterative_deepening },
+		{ "best_first", best_first },
+	};
+
+	auto it = names.find(name);
+	if (it == names.end())
+		return std::nullopt;
+
+	return it->second;
+}
 
-	push_marker novel;
+// Bounds of a transform; negative values are unbounded
+struct TransformLimits {
+	Strategy strategy = breadth_first;
 
-	// The original expression itself goes in here
-	table.push(expr, pm);
+	// Rewrites away from the original expression
+	int steps = -1;
 
-	// For now there is nothing to do for atoms
-	if (expr.etn->is <_expr_tree_atom> ())
-		return;
+	// Levels of subterms that are rewritten (the root
+	// alone is one level); zero does nothing at all
+	int depth = -1;
 
-	scoped_memory_manager smm;
-	auto opt_sub_lhs = match(stmt.lhs, expr);
-	if (opt_sub_lhs) {
-		auto sub_lhs = opt_sub_lhs.value().drop(smm);
-		auto subbed = sub_lhs.apply(stmt.rhs).drop(table.smm);
-		table.push(subbed, novel);
+	// Expressions pushed by the transform
+	int size = -1;
+};
+
+// Expression found by a transform, by index in the table, with
+// the rewrites it took to reach it and its size (for ordering)
+struct _transform_item {
+	uint32_t index;
+	uint32_t steps;
+	uint32_t size;
+};
+
+// Expressions yet to be expanded, in the order of a strategy
+struct _transform_frontier {
+	Strategy strategy;
+	std::vector <_transform_item> items;
+
+	// Items before this one are popped (breadth first only)
+	size_t head = 0;
+
+	static bool later(const _transform_item &A, const _transform_item &B) {
+		if (A.size != B.size)
+			return A.size > B.size;
+
+		return A.index > B.index;
 	}
 
-	auto opt_sub_rhs = match(stmt.rhs, expr);
-	if (opt_sub_rhs) {
-		auto sub_rhs = opt_sub_rhs.value().drop(smm);
-		auto subbed = sub_rhs.apply(stmt.lhs).drop(table.smm);
-		table.push(subbed, novel);
+	bool empty() const {
+		return head == items.size();
 	}
 
-	// Trying all children as well
-	// TODO: use the same table, create a mark stack, then clear it all
-	std::vector <push_marker> markers;
-
-	expr.etn->forall_operands(
-		[&](const ETN_ref &child) {
-			// TODO: subsignature if small enough?
-			push_marker pm;
-			Expression cexpr { child, expr.signature };
-			_transform(table, cexpr, stmt, pm, exhaustive, std::max(depth - 1, -1));
-			markers.push_back(pm);
+	void push(const _transform_item &item) {
+		items.push_back(item);
+		if (strategy == best_first)
+			std::push_heap(items.begin(), items.end(), later);
+	}
+
+	_transform_item pop() {
+		if (strategy == best_first)
+			std::pop_heap(items.begin(), items.end(), later);
+
+		if (strategy != breadth_first) {
+			_transform_item item = items.back();
+			items.pop_back();
+			return item;
 		}
-	);
 
-	// Run through all permutations
-	// TODO: specialization for low operand counts
-	if (markers.size() != 2) {
-		fmt::println("subexpression transforms are only supported for binary ops");
+		_transform_item item = items[head++];
+
+		// Popped items are dropped once they are the majority
+		if (head > 64 && 2 * head > items.size()) {
+			items.erase(items.begin(), items.begin() + head);
+			head = 0;
+		}
+
+		return item;
+	}
+};
+
+static ETN_ref _relink(const ETN_ref &ref, ETN_ref next, scoped_memory_manager &smm)
+{
+	if (ref->next() == next)
+		return ref;
+
+	ETN_ref netn = clone_soft(ref, smm);
+	netn->next() = next;
+	return netn;
+}
+
+// Copy of a term with the subterm at the end of a path (from the
+// root) replaced; only the nodes on the path and the operands
+// before them are new, everything else is shared
+static ETN_ref _replace(const std::vector <ETN_ref> &path, ETN_ref replacement, scoped_memory_manager &smm)
+{
+	for (size_t i = path.size() - 1; i > 0; i--) {
+		const ETN_ref &child = path[i];
+		const auto &tree = path[i - 1]->as <_expr_tree_op> ();
+
+		std::vector <ETN_ref> before;
+		for (ETN_ref head = tree.down; head != child; head = head->next())
+			before.push_back(head);
+
+		ETN_ref down = _relink(replacement, child->next(), smm);
+		for (size_t j = before.size(); j-- > 0; )
+			down = _relink(before[j], down, smm);
+
+		replacement = smm.make(_expr_tree_op {
+			.op = tree.op,
+			.dom = tree.dom,
+			.down = down,
+			.next = nullptr
+		});
+	}
+
+	return _relink(replacement, nullptr, smm);
+}
+
+// Search over the expressions that a set of rules rewrites an
+// expression into, one position at a time; the table is the
+// visited set, and the results of a transform are all entries
+// it pushes, which are contiguous at the end of the table
+struct _transform_search {
+	ExprTable_L1 &table;
+	const _transform_rules &rules;
+	const TransformLimits &limits;
+	_transform_frontier frontier;
+
+	// First entry pushed by the search; earlier
+	// entries count as visited for good
+	size_t begin;
+
+	// Whether entries may be expanded again if reached
+	// in fewer rewrites, and the fewest so far for
+	// each (since the start of the round)
+	bool revisit;
+	std::vector <uint32_t> reached;
+
+	bool full() const {
+		return limits.size >= 0 && table.size() - begin >= (size_t) limits.size;
+	}
+
+	// Matches at the current position, reused across positions
+	std::vector <RuleMatch> matches;
+
+	bool reach(const Expression &, uint32_t);
+	void rewrite(const std::vector <ETN_ref> &, const Expression &, uint32_t, const RuleMatch &, scoped_memory_manager &);
+	void rewrite_ac(const std::vector <ETN_ref> &, const Expression &, uint32_t, uint32_t, scoped_memory_manager &);
+	void expand(const _transform_item &);
+	void round(uint32_t);
+};
+
+// True if the expression is pushed; otherwise, its
+// nodes can be freed right away
+bool _transform_search::reach(const Expression &expr, uint32_t steps)
+{
+	Expression interned = table.intern(expr);
+
+	size_t index = table.size();
+	bool novel = table.push(interned);
+	if (novel) {
+		reached.push_back(steps);
 	} else {
-		// TODO: product function
-		for (size_t i : markers[0]) {
-			for (size_t j : markers[1]) {
-				const auto &exlhs = table.flat_at(i);
-				const auto &exrhs = table.flat_at(j);
-
-				auto lhs = clone(exlhs.etn);
-				auto rhs = clone(exrhs.etn);
-				auto top = clone_soft(expr.etn);
-
-				top->as <_expr_tree_op> ().down = lhs;
-				lhs->next() = rhs;
-
-				Expression combined { top, expr.signature };
-				table.push(combined, novel);
-				table.smm.drop(top);
+		if (!revisit)
+			return false;
+
+		index = table.find(interned).value();
+		if (index < begin || reached[index - begin] <= steps)
+			return false;
+
+		reached[index - begin] = steps;
+	}
+
+	frontier.push({
+		.index = uint32_t(index),
+		.steps = steps,
+		.size = interned.etn->meta.size
+	});
+
+	return novel;
+}
+
+// Pushes the rewrite of the subterm at the end of a path by a
+// rule that matches it, in context; if it is not novel, its
+// nodes are freed right away
+void _transform_search::rewrite(const std::vector <ETN_ref> &path, const Expression &expr, uint32_t steps, const RuleMatch &m, scoped_memory_manager &owner)
+{
+	const RewriteProgram &program = rules.tree.rules[m.rule].program;
+
+	table_epoch epoch = table.checkpoint();
+
+	if (ETN_ref rewritten = program.instantiate(m.sub, owner)) {
+		ETN_ref etn = _replace(path, rewritten, owner);
+		Signature_ref signature = program.closed ? expr.signature : default_signature(*etn);
+		if (reach({ etn, signature }, steps))
+			return;
+	}
+
+	table.rollback(epoch);
+}
+
+// Same, modulo AC, where the index does not apply; the matches
+// of each rule cover every ordering of the operands
+void _transform_search::rewrite_ac(const std::vector <ETN_ref> &path, const Expression &expr, uint32_t steps, uint32_t id, scoped_memory_manager &owner)
+{
+	const Rule &rule = rules.tree.rules[id];
+
+	table_epoch epoch = table.checkpoint();
+
+	bool novel = false;
+	for (auto &sub : ac_match(rule.from.etn, path.back(), owner)) {
+		table_epoch single = table.checkpoint();
+
+		ETN_ref etn = _replace(path, sub.apply_shared(rule.to.etn, owner), owner);
+		Signature_ref signature = rule.program.closed ? expr.signature : default_signature(*etn);
+		if (reach({ etn, signature }, steps))
+			novel = true;
+		else
+			table.rollback(single);
+	}
+
+	if (!novel)
+		table.rollback(epoch);
+}
+
+// Rewrites an expression at every position within the depth
+// limit, visiting subterms in preorder without recursion
+void _transform_search::expand(const _transform_item &item)
+{
+	// Copy, as pushing may move the entries
+	Expression expr = table.flat_at(item.index);
+
+	scoped_memory_manager smm;
+
+	// Rewrites share nodes with the matched bindings, so those
+	// must live as long as the table; interned rewrites are
+	// copied into the store instead
+	scoped_memory_manager &owner = table.store ? smm : table.smm;
+
+	std::vector <ETN_ref> path { expr.etn };
+	while (!path.empty() && !full()) {
+		ETN_ref etn = path.back();
+
+		// For now there is nothing to do for atoms
+		if (etn->is <_expr_tree_op> () && table.modulo_ac) {
+			for (uint32_t id = 0; id < rules.tree.rules.size(); id++) {
+				if (rules.applicable(id) && !rules.ac_identity[id])
+					rewrite_ac(path, expr, item.steps + 1, id, owner);
+			}
+		} else if (etn->is <_expr_tree_op> ()) {
+			matches.clear();
+			rules.tree.match(etn, matches);
+			for (const RuleMatch &m : matches) {
+				if (rules.applicable(m.rule))
+					rewrite(path, expr, item.steps + 1, m, owner);
 			}
 		}
-	}
 
-	// If exhaustive, repeat the seach over novel expressions
-	if (exhaustive) {
-		for (size_t i : novel) {
-			Expression expr = table.flat_at(i);
-			_transform(table, expr, stmt, pm, exhaustive, depth);
+		bool deeper = limits.depth < 0 || path.size() < (size_t) limits.depth;
+		if (deeper && etn->is <_expr_tree_op> ()) {
+			path.push_back(etn->as <_expr_tree_op> ().down);
+			continue;
 		}
+
+		// Next sibling of the nearest node that has one
+		while (!path.empty()) {
+			ETN_ref last = path.back();
+			path.pop_back();
+			if (!path.empty() && last->next()) {
+				path.push_back(last->next());
+				break;
+			}
+		}
+	}
+}
+
+// Expands everything on the frontier that is fewer
+// than the given number of rewrites away
+void _transform_search::round(uint32_t bound)
+{
+	while (!frontier.empty() && !full()) {
+		_transform_item item = frontier.pop();
+
+		// Superseded by a shorter path
+		if (item.index >= begin && reached[item.index - begin] < item.steps)
+			continue;
+
+		if (item.steps < bound)
+			expand(item);
+	}
+}
+
+void _transform(ExprTable_L1 &table, const Expression &expr, const DiscriminationTree &tree, const TransformLimits &limits)
+{
+	if (limits.depth == 0)
+		return;
+
+	_transform_rules rules(tree);
+
+	// Only with a bound on rewrites can a longer path
+	// to an expression hide one that is short enough
+	Strategy strategy = limits.strategy;
+	bool revisit = strategy == iterative_deepening
+		|| (strategy != breadth_first && limits.steps >= 0);
+
+	_transform_search search {
+		.table = table,
+		.rules = rules,
+		.limits = limits,
+		.frontier = { strategy },
+		.begin = table.size(),
+		.revisit = revisit
+	};
+
+	// The original expression itself goes in here, unless
+	// it is already in the table (in which case it is
+	// still expanded, but never again)
+	Expression origin = table.intern(expr);
+
+	_transform_item item {
+		.index = uint32_t(table.size()),
+		.steps = 0,
+		.size = origin.etn->meta.size
+	};
+
+	if (table.push(origin))
+		search.reached.push_back(0);
+	else
+		item.index = table.find(origin).value();
+
+	uint32_t bound = limits.steps < 0 ? UINT32_MAX : limits.steps;
+	if (strategy != iterative_deepening) {
+		search.frontier.push(item);
+		search.round(bound);
+		return;
 	}
 
-	// Record the novel expressions as well
-	pm.insert(pm.end(), novel.begin(), novel.end());
+	for (uint32_t depth = 1; depth <= bound && !search.full(); depth++) {
+		size_t size = table.size();
 
-	// Erase generated expressions
-	for (const auto &pm : markers)
-		table.clear(pm);
+		std::fill(search.reached.begin(), search.reached.end(), UINT32_MAX);
+		if (item.index >= search.begin)
+			search.reached[item.index - search.begin] = 0;
+
+		search.frontier.push(item);
+		search.round(depth);
+
+		if (table.size() == size)
+			break;
+	}
 }
 
-// Result transform(const std::vector <Value> &args, const Options &options)
-// {
-// 	if (auto expr_stmt = overload <Expression, Statement> (args)) {
-// 		auto [expr, stmt] = expr_stmt.value();
-//
-// 		Integer depth = check_option(options, "depth", (Integer) -1);
-// 		bool exhaustive = check_option(options, "exhaustive", true);
-//
-// 		ExprTable_L1 table;
-// 		push_marker pm;
-// 		_transform(table, expr, stmt, pm, exhaustive, depth);
-// 		fmt::println("# of expressions generated: {}", table.unique);
-// 		list_table(table);
-// 		return Void();
-// 	}
-//
-// 	// TODO: pass error message to string
-// 	fmt::println("transform expected (expr, stmt)");
-// 	return Error();
-// }
+// Expressions that the left side of a statement is rewritten into,
+// either by the statements and arguments given after it, or else
+// by every rule of the session; also shows whether the right side
+// is among them
+Result transform(const std::vector <Value> &args, const Options &options, const DiscriminationTree &axioms)
+{
+	bool valid = !args.empty() && args.front().is <Statement> ();
+
+	DiscriminationTree given;
+	for (size_t i = 1; valid && i < args.size(); i++) {
+		if (args[i].is <Statement> ())
+			given.insert(args[i].as <Statement> (), "transform");
+		else if (args[i].is <Argument> ())
+			given.insert(args[i].as <Argument> (), "transform");
+		else
+			valid = false;
+	}
+
+	if (valid) {
+		Statement stmt = args.front().as <Statement> ();
+
+		bool exhaustive = check_option(options, "exhaustive", true);
+
+		LiteralString name = check_option(options, "strategy", LiteralString("breadth_first"));
+		auto strategy = _strategy(name);
+		if (!strategy) {
+			fmt::println("unknown strategy {}", (const std::string &) name);
+			return Error();
+		}
+
+		TransformLimits limits {
+			.strategy = strategy.value(),
+			.steps = exhaustive ? -1 : 1,
+			.depth = (int) check_option(options, "depth", (Integer) -1),
+			.size = (int) check_option(options, "size", (Integer) -1)
+		};
+
+		ExprTable_L1 table;
+		_transform(table, stmt.lhs, args.size() > 1 ? given : axioms, limits);
+		fmt::println("# of expressions generated: {}", table.size());
+		list_table(table);
+
+		if (table.find(stmt.rhs))
+			fmt::println("right side is reached");
+
+		return Void();
+	}
+
+	// TODO: pass error message to string
+	fmt::println("transform expected (stmt, stmt/arg...)");
+	return Error();
+}
+
+// Cheapest form of both sides of a statement under any number of
+// others, by equality saturation instead of enumerating rewrites;
+// the sides share a graph, which also shows whether they are equal
+Result saturate(const std::vector <Value> &args, const Options &options)
+{
+	bool valid = !args.empty();
+
+	std::vector <Statement> stmts;
+	for (size_t i = 0; valid && i < args.size(); i++) {
+		valid = args[i].is <Statement> ();
+		if (valid)
+			stmts.push_back(args[i].as <Statement> ());
+	}
+
+	if (valid) {
+		Statement stmt = stmts.front();
+		stmts.erase(stmts.begin());
+
+		Integer iterations = check_option(options, "iterations", (Integer) 16);
+		Integer limit = check_option(options, "nodes", (Integer) 10000);
+
+		EGraph graph;
+		EClassId lhs = graph.add(stmt.lhs.etn);
+		EClassId rhs = graph.add(stmt.rhs.etn);
+		bool saturated = graph.saturate(stmts, iterations, limit);
+		fmt::println("# of e-nodes: {}, e-classes: {}{}", graph.size(), graph.live,
+			saturated ? "" : " (stopped at limit)");
+
+		scoped_memory_manager smm;
+		for (EClassId id : { lhs, rhs }) {
+			ETN_ref best = graph.extract(id, smm);
+			Expression result { best, default_signature(stmt.signature, *best) };
+			fmt::println("best: {}", result);
+		}
+
+		if (graph.find(lhs) == graph.find(rhs))
+			fmt::println("both sides are equal");
+
+		return Void();
+	}
+
+	fmt::println("saturate expected (stmt, stmt...)");
+	return Error();
+}
 
 Result relation(const std::vector <Value> &args, const Options &)
 {
@@ -240,6 +629,10 @@ struct _drop_dispatcher {
 			smm.drop(arg);
 	}
 
+	void operator()(PushOption &option) {
+		smm.drop(option.arg);
+	}
+
 	template <typename T>
 	void operator()(const T &) {
 		fmt::println("drop not implemented for this type...");
@@ -248,8 +641,15 @@ struct _drop_dispatcher {
 
 // Set of functions
 static std::unordered_map <Symbol, Function> functions {
-	// { "transform", transform },
 	{ "relation", relation },
+	{ "saturate", saturate },
+};
+
+// Functions that are also given the rules of the session
+using RuleFunction = std::function <Result (const std::vector <Value> &, const Options &, const DiscriminationTree &)>;
+
+static std::unordered_map <Symbol, RuleFunction> rule_functions {
+	{ "transform", transform },
 };
 
 // Context for any session
@@ -258,17 +658,29 @@ struct Oxidius {
 	SymbolTable table;
 	Options options;
 
+	// Rewrite rules from every statement in the table,
+	// and from the conclusion of every argument
+	DiscriminationTree axioms;
+
 	Result operator()(const DefineSymbol &ds) {
 		auto value = table.resolve(ds.value);
 		if (!value)
 			return Error();
 		fmt::println("value: {}", value.value());
 		table[ds.identifier] = value.value();
+
+		axioms.remove(ds.identifier);
+		if (value->is <Statement> ())
+			axioms.insert(value->as <Statement> (), ds.identifier);
+		else if (value->is <Argument> ())
+			axioms.insert(value->as <Argument> (), ds.identifier);
+
 		return Void();
 	}
 
 	Result operator()(const Call &call) {
-		if (!functions.contains(call.ftn)) {
+		bool ruled = rule_functions.contains(call.ftn);
+		if (!functions.contains(call.ftn) && !ruled) {
 			fmt::println("no function {} defined", call.ftn);
 			return Error();
 		}
@@ -282,7 +694,11 @@ struct Oxidius {
 			resolved.push_back(rrv.value());
 		}
 
-		return functions[call.ftn](resolved, options)
+		Result result = ruled
+			? rule_functions[call.ftn](resolved, options, axioms)
+			: functions[call.ftn](resolved, options);
+
+		return result
 			.passthrough([&]() {
 				options.clear();
 			});
@@ -1,3 +1,8 @@
+#include <algorithm>
+#include <bit>
+#include <functional>
+#include <unordered_map>
+
 #include "include/match.hpp"
 #include "include/formalism.hpp"
 #include "include/format.hpp"
@@ -18,9 +23,9 @@ bool equal(const Atom &A, const Atom &B)
 				&& (other.as <Integer> () == i);
 		}
 
-		bool operator()(const Real &r) {
-			return other.is <Symbol> ()
-				&& (other.as <Real> () == r);
+		bool operator()(const InternedReal &r) {
+			return other.is <InternedReal> ()
+				&& (other.as <InternedReal> () == r);
 		}
 
 		bool operator()(const Symbol &sym) {
@@ -35,6 +40,12 @@ bool equal(const Atom &A, const Atom &B)
 
 bool equal(const ETN_ref &A, const ETN_ref &B)
 {
+	if (A == B)
+		return true;
+
+	if (A->meta.hash != B->meta.hash || A->meta.size != B->meta.size)
+		return false;
+
 	if (A->index() != B->index())
 		return false;
 
@@ -73,17 +84,169 @@ bool equal(const Expression &A, const Expression &B)
 	return equal(A.etn, B.etn);
 }
 
+// Comparison modulo AC
+static void _ac_operands(const ETN_ref &etn, Operation op, std::vector <ETN_ref> &operands)
+{
+	ETN_ref head = etn->as <_expr_tree_op> ().down;
+	while (head) {
+		if (head->is <_expr_tree_op> () && head->as <_expr_tree_op> ().op == op)
+			_ac_operands(head, op, operands);
+		else
+			operands.push_back(head);
+
+		head = head->next();
+	}
+}
+
+// Operands in canonical order
+static std::vector <ETN_ref> _ordered_operands(const ETN_ref &etn)
+{
+	std::vector <ETN_ref> operands;
+
+	Operation op = etn->as <_expr_tree_op> ().op;
+	if (!is_ac(op)) {
+		etn->forall_operands([&](const ETN_ref &head) {
+			operands.push_back(head);
+		});
+
+		return operands;
+	}
+
+	_ac_operands(etn, op, operands);
+	std::sort(operands.begin(), operands.end(),
+		[](const ETN_ref &A, const ETN_ref &B) {
+			return ac_compare(A, B) < 0;
+		}
+	);
+
+	return operands;
+}
+
+template <typename T>
+static int _compare(const T &a, const T &b)
+{
+	return (a > b) - (a < b);
+}
+
+static int _atom_compare(const Atom &A, const Atom &B)
+{
+	if (A.index() != B.index())
+		return _compare(A.index(), B.index());
+
+	if (A.is <Integer> ())
+		return _compare(A.as <Integer> (), B.as <Integer> ());
+	if (A.is <InternedReal> ())
+		return _compare(A.as <InternedReal> ().index, B.as <InternedReal> ().index);
+
+	return _compare(A.as <Symbol> ().id, B.as <Symbol> ().id);
+}
+
+int ac_compare(const ETN_ref &A, const ETN_ref &B)
+{
+	if (A == B)
+		return 0;
+
+	// Hashes decide almost every comparison
+	if (int c = _compare(A->ac_hash(), B->ac_hash()))
+		return c;
+
+	if (A->index() != B->index())
+		return _compare(A->index(), B->index());
+
+	if (A->is <_expr_tree_atom> ())
+		return _atom_compare(A->as <_expr_tree_atom> ().atom, B->as <_expr_tree_atom> ().atom);
+
+	Operation op_A = A->as <_expr_tree_op> ().op;
+	Operation op_B = B->as <_expr_tree_op> ().op;
+	if (op_A != op_B)
+		return _compare(op_A, op_B);
+
+	auto operands_A = _ordered_operands(A);
+	auto operands_B = _ordered_operands(B);
+	if (operands_A.size() != operands_B.size())
+		return _compare(operands_A.size(), operands_B.size());
+
+	for (size_t i = 0; i < operands_A.size(); i++) {
+		if (int c = ac_compare(operands_A[i], operands_B[i]))
+			return c;
+	}
+
+	return 0;
+}
+
+bool ac_equal(const ETN_ref &A, const ETN_ref &B)
+{
+	return ac_compare(A, B) == 0;
+}
+
+bool ac_equal(const Expression &A, const Expression &B)
+{
+	return ac_equal(A.etn, B.etn);
+}
+
+static ETN_ref _canonical(const ETN_ref &etn, ETN_ref next, scoped_memory_manager &smm)
+{
+	if (etn->is <_expr_tree_atom> ()) {
+		ETN_ref atom = smm.make(etn->as <_expr_tree_atom> ());
+		atom->next() = next;
+		return atom;
+	}
+
+	auto operands = _ordered_operands(etn);
+
+	ETN_ref down = nullptr;
+	for (auto it = operands.rbegin(); it != operands.rend(); it++)
+		down = _canonical(*it, down, smm);
+
+	const auto &tree = etn->as <_expr_tree_op> ();
+	return smm.make(_expr_tree_op {
+		.op = tree.op,
+		.dom = tree.dom,
+		.down = down,
+		.next = next
+	});
+}
+
+ETN_ref canonical(const ETN_ref &etn, scoped_memory_manager &smm)
+{
+	return _canonical(etn, nullptr, smm);
+}
+
+Expression canonical(const Expression &expr, scoped_memory_manager &smm)
+{
+	return Expression {
+		.etn = canonical(expr.etn, smm),
+		.signature = expr.signature
+	};
+}
+
+// Substitution methods
+void Substitution::bind(const Symbol &sym, ETN_ref etn)
+{
+	if (spilled.empty() && count < fixed_capacity) {
+		fixed[count++] = { sym, etn };
+		return;
+	}
+
+	if (spilled.empty())
+		spilled.assign(fixed, fixed + count);
+
+	spilled.push_back({ sym, etn });
+	count++;
+}
+
 // Finding matches
 std::optional <Substitution> add_substitution(const Substitution &S, const Symbol &sym, const Expression &expr)
 {
-	Substitution result = S;
-
-	if (result.count(sym) && !equal(result[sym], expr)) {
-		fmt::println("incompatible matching:\n{}={}vs.\n{}", sym, *result[sym].etn, *expr.etn);
+	ETN_ref bound = S.find(sym);
+	if (bound && !equal(bound, expr.etn)) {
+		fmt::println("incompatible matching:\n{}={}vs.\n{}", sym, *bound, *expr.etn);
 		return std::nullopt;
 	}
 
-	result[sym] = expr;
+	Substitution result = S;
+	if (!bound)
+		result.bind(sym, expr.etn);
 
 	return result;
 }
@@ -91,80 +254,119 @@ std::optional <Substitution> add_substitution(const Substitution &S, const Symbo
 std::optional <Substitution> join(const Substitution &A, const Substitution &B)
 {
 	Substitution result = A;
-	for (const auto &[s, expr] : B) {
-		auto r = add_substitution(result, s, expr);
-		if (!r)
+	for (const auto &[sym, etn] : B) {
+		ETN_ref bound = result.find(sym);
+		if (!bound)
+			result.bind(sym, etn);
+		else if (!equal(bound, etn))
 			return std::nullopt;
-
-		result = r.value();
 	}
 
 	return result;
 }
 
-std::optional <Substitution> match(const ETN_ref &source, const ETN_ref &victim)
+// Bindings are added in place; the caller undoes them on failure
+template <typename C>
+static bool _match(const ETN_ref &source, const ETN_ref &victim, Substitution &sub, C &&copy)
 {
-	scoped_memory_manager smm;
 	if (source->is <_expr_tree_op> ()) {
 		if (!victim->is <_expr_tree_op> ())
-			return std::nullopt;
+			return false;
 
-		auto tree_source = std::get <_expr_tree_op> (*source);
-		auto tree_victim = std::get <_expr_tree_op> (*victim);
+		// Symbols bind whole subtrees, so the victim
+		// can never be smaller or shallower
+		if (victim->meta.size < source->meta.size || victim->meta.depth < source->meta.depth)
+			return false;
 
-		Operation op_source = tree_source.op;
-		Operation op_victim = tree_victim.op;
+		const auto &tree_source = source->as <_expr_tree_op> ();
+		const auto &tree_victim = victim->as <_expr_tree_op> ();
 
-		if (op_source != op_victim) {
-			return std::nullopt;
-		} else {
-			Substitution sub;
+		if (tree_source.op != tree_victim.op)
+			return false;
 
-			ETN_ref source_head = tree_source.down;
-			ETN_ref victim_head = tree_victim.down;
+		ETN_ref source_head = tree_source.down;
+		ETN_ref victim_head = tree_victim.down;
 
-			std::vector <ETN_ref> freeze;
-			while (source_head && victim_head) {
-				auto opt_sub_child = match(source_head, victim_head);
-				if (!opt_sub_child) {
-					smm.drop(sub);
-					return std::nullopt;
-				}
+		while (source_head && victim_head) {
+			if (!_match(source_head, victim_head, sub, copy))
+				return false;
 
-				auto sub_child = opt_sub_child.value();
+			source_head = source_head->next();
+			victim_head = victim_head->next();
+		}
 
-				auto joined = join(sub, sub_child);
-				if (!joined) {
-					smm.drop(sub);
-					return std::nullopt;
-				}
+		// TODO: check uneven sizes...
 
-				sub = joined.value();
+		return true;
+	}
 
-				source_head = source_head->next();
-				victim_head = victim_head->next();
-			}
+	// Constants match equal constants
+	const auto &atom_source = source->as <_expr_tree_atom> ().atom;
+	if (!atom_source.is <Symbol> ()) {
+		return victim->is <_expr_tree_atom> ()
+			&& equal(atom_source, victim->as <_expr_tree_atom> ().atom);
+	}
 
-			// TODO: check uneven sizes...
+	Symbol s = atom_source.as <Symbol> ();
 
-			return sub;
-		}
-	} else {
-		auto atom_source = source->as <_expr_tree_atom> ().atom;
+	// Repeated symbols must bind equal subtrees
+	if (ETN_ref bound = sub.find(s))
+		return equal(bound, victim);
 
-		if (atom_source.is <Symbol> ()) {
-			Symbol s = atom_source.as <Symbol> ();
+	sub.bind(s, copy(victim));
+	return true;
+}
 
-			Expression matched {
-				clone(victim),
-				default_signature(*victim)
-			};
+std::optional <Substitution> match(const ETN_ref &source, const ETN_ref &victim)
+{
+	Substitution sub;
 
-			return Substitution { {s, matched} };
-		}
+	auto copy = [](const ETN_ref &ref) { return clone(ref); };
+	if (!_match(source, victim, sub, copy)) {
+		scoped_memory_manager smm;
+		smm.drop(sub);
+		return std::nullopt;
 	}
 
-	return std::nullopt;
+	return sub;
+}
+
+bool match(const ETN_ref &source, const ETN_ref &victim, Substitution &sub, scoped_memory_manager &smm)
+{
+	auto copy = [&](const ETN_ref &ref) { return clone(ref, smm); };
+
+	// Bindings of failed matches are freed along with them
+	size_t m = sub.mark();
+	node_arena::mark nodes = smm.arena.checkpoint();
+	if (!_match(source, victim, sub, copy)) {
+		sub.undo(m);
+		smm.arena.rollback(nodes);
+		return false;
+	}
+
+	return true;
+}
+
+bool match(const ETN_ref &source, const ETN_ref &victim, Substitution &sub)
+{
+	auto borrow = [](const ETN_ref &ref) { return ref; };
+
+	size_t m = sub.mark();
+	if (!_match(source, victim, sub, borrow)) {
+		sub.undo(m);
+		return false;
+	}
+
+	return true;
+}
+
+std::optional <Substitution> match(const ETN_ref &source, const ETN_ref &victim, scoped_memory_manager &smm)
+{
+	Substitution sub;
+	if (!match(source, victim, sub, smm))
+		return std::nullopt;
+
+	return sub;
 }
 
 std::optional <Substitution> match(const Expression &source, const Expression &victim)
@@ -172,35 +374,576 @@ std::optional <Substitution> match(const Expression &source, const Expression &v
 	return match(source.etn, victim.etn);
 }
 
-// Substitution methods
-ETN_ref Substitution::apply(const ETN_ref &etn)
+std::optional <Substitution> match(const Expression &source, const Expression &victim, scoped_memory_manager &smm)
+{
+	return match(source.etn, victim.etn, smm);
+}
+
+// Matching modulo AC, by backtracking over the trail of a
+// substitution; each solution is passed to a continuation,
+// with its bindings in place
+using _ac_continuation = std::function <void ()>;
+
+struct _ac_matcher {
+	Substitution &sub;
+	scoped_memory_manager &smm;
+
+	void match(const ETN_ref &, const ETN_ref &, const _ac_continuation &);
+	void sequence(const std::vector <ETN_ref> &, const std::vector <ETN_ref> &, size_t, const _ac_continuation &);
+	void ac(const ETN_ref &, const ETN_ref &, const _ac_continuation &);
+};
+
+// State of the match of one flattened AC operation; rigid
+// operands (anything but a symbol) are assigned one victim
+// operand each, then symbols take the rest between them
+struct _ac_operation {
+	_ac_matcher &matcher;
+	const _expr_tree_op &tree;
+	std::vector <ETN_ref> victims;
+	std::vector <ETN_ref> rigid;
+	std::vector <uint64_t> candidates;
+	std::vector <Symbol> symbols;
+
+	void assign(size_t, uint64_t, const _ac_continuation &);
+	void distribute(size_t, uint64_t, const _ac_continuation &);
+	ETN_ref gather(uint64_t);
+};
+
+// Kuhn's augmenting paths, over candidate masks
+static bool _augment(size_t i, const std::vector <uint64_t> &candidates, std::vector <int> &owner, uint64_t &seen)
+{
+	for (uint64_t c = candidates[i] & ~seen; c; c &= c - 1) {
+		int v = std::countr_zero(c);
+		seen |= 1ull << v;
+
+		if (owner[v] < 0 || _augment(owner[v], candidates, owner, seen)) {
+			owner[v] = i;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Whether every rigid operand can have a distinct candidate
+static bool _assignable(const std::vector <uint64_t> &candidates)
+{
+	std::vector <int> owner(64, -1);
+	for (size_t i = 0; i < candidates.size(); i++) {
+		uint64_t seen = 0;
+		if (!_augment(i, candidates, owner, seen))
+			return false;
+	}
+
+	return true;
+}
+
+// Necessary for a rigid operand to match a victim operand (and
+// sufficient for constants); sizes count every node, and symbols
+// bind at least one
+static bool _may_match(const ETN_ref &pattern, const ETN_ref &victim)
+{
+	if (pattern->is <_expr_tree_atom> ()) {
+		return victim->is <_expr_tree_atom> ()
+			&& equal(pattern->as <_expr_tree_atom> ().atom, victim->as <_expr_tree_atom> ().atom);
+	}
+
+	if (!victim->is <_expr_tree_op> ())
+		return false;
+
+	return pattern->as <_expr_tree_op> ().op == victim->as <_expr_tree_op> ().op
+		&& victim->meta.size >= pattern->meta.size;
+}
+
+void _ac_matcher::match(const ETN_ref &source, const ETN_ref &victim, const _ac_continuation &k)
+{
+	if (source->is <_expr_tree_atom> ()) {
+		const auto &atom = source->as <_expr_tree_atom> ().atom;
+		if (!atom.is <Symbol> ()) {
+			if (_may_match(source, victim))
+				k();
+
+			return;
+		}
+
+		Symbol s = atom.as <Symbol> ();
+		if (ETN_ref bound = sub.find(s)) {
+			if (ac_equal(bound, victim))
+				k();
+
+			return;
+		}
+
+		size_t m = sub.mark();
+		sub.bind(s, victim);
+		k();
+		sub.undo(m);
+		return;
+	}
+
+	if (!_may_match(source, victim))
+		return;
+
+	if (is_ac(source->as <_expr_tree_op> ().op))
+		return ac(source, victim, k);
+
+	std::vector <ETN_ref> sources;
+	std::vector <ETN_ref> victims;
+	source->forall_operands([&](const ETN_ref &head) { sources.push_back(head); });
+	victim->forall_operands([&](const ETN_ref &head) { victims.push_back(head); });
+
+	if (sources.size() == victims.size())
+		sequence(sources, victims, 0, k);
+}
+
+void _ac_matcher::sequence(const std::vector <ETN_ref> &sources, const std::vector <ETN_ref> &victims, size_t i, const _ac_continuation &k)
+{
+	if (i == sources.size())
+		return k();
+
+	match(sources[i], victims[i], [&]() {
+		sequence(sources, victims, i + 1, k);
+	});
+}
+
+void _ac_matcher::ac(const ETN_ref &source, const ETN_ref &victim, const _ac_continuation &k)
+{
+	const auto &tree = victim->as <_expr_tree_op> ();
+
+	_ac_operation operation { *this, tree };
+
+	std::vector <ETN_ref> sources;
+	_ac_operands(source, tree.op, sources);
+	_ac_operands(victim, tree.op, operation.victims);
+
+	const auto &victims = operation.victims;
+	if (victims.size() < sources.size() || victims.size() > 64)
+		return;
+
+	for (const ETN_ref &etn : sources) {
+		if (etn->is <_expr_tree_atom> () && etn->as <_expr_tree_atom> ().atom.is <Symbol> ()) {
+			operation.symbols.push_back(etn->as <_expr_tree_atom> ().atom.as <Symbol> ());
+			continue;
+		}
+
+		uint64_t mask = 0;
+		for (size_t v = 0; v < victims.size(); v++) {
+			if (_may_match(etn, victims[v]))
+				mask |= 1ull << v;
+		}
+
+		if (!mask)
+			return;
+
+		operation.rigid.push_back(etn);
+		operation.candidates.push_back(mask);
+	}
+
+	// Without symbols to take the rest, the counts must agree
+	if (operation.symbols.empty() && victims.size() != sources.size())
+		return;
+
+	if (!_assignable(operation.candidates))
+		return;
+
+	// Most constrained rigid operands first
+	std::vector <size_t> order(operation.rigid.size());
+	for (size_t i = 0; i < order.size(); i++)
+		order[i] = i;
+
+	std::sort(order.begin(), order.end(),
+		[&](size_t a, size_t b) {
+			return std::popcount(operation.candidates[a]) < std::popcount(operation.candidates[b]);
+		}
+	);
+
+	std::vector <ETN_ref> rigid;
+	std::vector <uint64_t> candidates;
+	for (size_t i : order) {
+		rigid.push_back(operation.rigid[i]);
+		candidates.push_back(operation.candidates[i]);
+	}
+
+	operation.rigid = rigid;
+	operation.candidates = candidates;
+	operation.assign(0, 0, k);
+}
+
+void _ac_operation::assign(size_t i, uint64_t used, const _ac_continuation &k)
+{
+	if (i == rigid.size())
+		return distribute(0, used, k);
+
+	for (uint64_t c = candidates[i] & ~used; c; c &= c - 1) {
+		int v = std::countr_zero(c);
+		matcher.match(rigid[i], victims[v], [&]() {
+			assign(i + 1, used | (1ull << v), k);
+		});
+	}
+}
+
+void _ac_operation::distribute(size_t i, uint64_t used, const _ac_continuation &k)
+{
+	uint64_t all = (victims.size() == 64) ? ~0ull : (1ull << victims.size()) - 1;
+	uint64_t rest = all & ~used;
+
+	if (i == symbols.size()) {
+		if (!rest)
+			k();
+
+		return;
+	}
+
+	// Every remaining symbol takes at least one operand
+	size_t left = symbols.size() - i;
+	if ((size_t) std::popcount(rest) < left)
+		return;
+
+	Substitution &sub = matcher.sub;
+
+	Symbol s = symbols[i];
+	if (ETN_ref bound = sub.find(s)) {
+		// Bound to a single operand, or to several of them as
+		// the same operation, which each take up one operand
+		std::vector <ETN_ref> parts;
+		if (bound->is <_expr_tree_op> () && bound->as <_expr_tree_op> ().op == tree.op)
+			_ac_operands(bound, tree.op, parts);
+		else
+			parts.push_back(bound);
+
+		uint64_t taken = 0;
+		for (const ETN_ref &part : parts) {
+			uint64_t c = rest & ~taken;
+			while (c && !ac_equal(part, victims[std::countr_zero(c)]))
+				c &= c - 1;
+
+			if (!c)
+				return;
+
+			taken |= c & -c;
+		}
+
+		return distribute(i + 1, used | taken, k);
+	}
+
+	// The last symbol takes all that is left
+	uint64_t subset = rest;
+	if (left == 1) {
+		size_t m = sub.mark();
+		sub.bind(s, gather(subset));
+		distribute(i + 1, all, k);
+		sub.undo(m);
+		return;
+	}
+
+	for (; subset; subset = (subset - 1) & rest) {
+		if ((size_t) std::popcount(rest & ~subset) < left - 1)
+			continue;
+
+		size_t m = sub.mark();
+		sub.bind(s, gather(subset));
+		distribute(i + 1, used | subset, k);
+		sub.undo(m);
+	}
+}
+
+// Operands of a subset, as the operation over them
+ETN_ref _ac_operation::gather(uint64_t subset)
+{
+	scoped_memory_manager &smm = matcher.smm;
+
+	std::vector <ETN_ref> operands;
+	for (uint64_t c = subset; c; c &= c - 1)
+		operands.push_back(victims[std::countr_zero(c)]);
+
+	if (operands.size() == 1)
+		return operands.back();
+
+	// Operands are relinked, so only their roots are copied
+	ETN_ref result = clone_soft(operands.back(), smm);
+	result->next() = nullptr;
+
+	for (size_t i = operands.size() - 1; i-- > 0; ) {
+		ETN_ref lhs = clone_soft(operands[i], smm);
+		lhs->next() = result;
+
+		result = smm.make(_expr_tree_op {
+			.op = tree.op,
+			.dom = tree.dom,
+			.down = lhs,
+			.next = nullptr
+		});
+	}
+
+	return result;
+}
+
+// Order independent hash of the bindings, modulo AC
+static uint64_t _ac_key(const Substitution &sub)
+{
+	uint64_t key = 0;
+	for (const auto &[sym, etn] : sub)
+		key += _expr_tree_meta::combine(sym.id, etn->ac_hash());
+
+	return key;
+}
+
+// Bindings that are equal modulo AC
+static bool _ac_same(const Substitution &A, const Substitution &B)
+{
+	if (A.size() != B.size())
+		return false;
+
+	for (const auto &[sym, etn] : A) {
+		ETN_ref other = B.find(sym);
+		if (!other || !ac_equal(etn, other))
+			return false;
+	}
+
+	return true;
+}
+
+std::vector <Substitution> ac_match(const ETN_ref &source, const ETN_ref &victim, scoped_memory_manager &smm)
+{
+	std::vector <Substitution> result;
+
+	// Equal operands give the same bindings more than once
+	std::unordered_multimap <uint64_t, size_t> seen;
+
+	Substitution sub;
+	_ac_matcher matcher { sub, smm };
+	matcher.match(source, victim, [&]() {
+		uint64_t key = _ac_key(sub);
+
+		auto [begin, end] = seen.equal_range(key);
+		for (auto it = begin; it != end; it++) {
+			if (_ac_same(result[it->second], sub))
+				return;
+		}
+
+		seen.emplace(key, result.size());
+		result.push_back(sub);
+	});
+
+	return result;
+}
+
+std::vector <Substitution> ac_match(const Expression &source, const Expression &victim, scoped_memory_manager &smm)
 {
+	return ac_match(source.etn, victim.etn, smm);
+}
+
+// Compiled matching
+static void _compile(const ETN_ref &etn, uint16_t reg, std::vector <Symbol> &seen, MatchProgram &program)
+{
+	program.registers = std::max(program.registers, (size_t) reg + 1);
+
 	if (etn->is <_expr_tree_op> ()) {
-		auto tree = etn->as <_expr_tree_op> ();
+		program.code.push_back({
+			.code = MatchProgram::check,
+			.reg = reg,
+			.op = etn->as <_expr_tree_op> ().op,
+			.size = etn->meta.size,
+			.depth = etn->meta.depth
+		});
 
-		ETN_ref netn = new ETN(tree);
+		bool first = true;
+		etn->forall_operands([&](const ETN_ref &head) {
+			if (!first)
+				program.code.push_back({ .code = MatchProgram::next, .reg = uint16_t(reg + 1) });
 
-		ETN_ref head = tree.down;
+			_compile(head, reg + 1, seen, program);
+			first = false;
+		});
 
-		std::queue <ETN_ref> list;
-		while (head) {
-			list.push(apply(head));
-			head = head->next();
+		return;
+	}
+
+	const auto &atom = etn->as <_expr_tree_atom> ().atom;
+	if (!atom.is <Symbol> ()) {
+		program.code.push_back({ .code = MatchProgram::constant, .reg = reg, .etn = etn });
+		return;
+	}
+
+	Symbol sym = atom.as <Symbol> ();
+
+	MatchProgram::Code code = MatchProgram::compare;
+
+	auto it = std::find(seen.begin(), seen.end(), sym);
+	if (it == seen.end()) {
+		code = MatchProgram::bind;
+		it = seen.insert(it, sym);
+	}
+
+	program.code.push_back({
+		.code = code,
+		.reg = reg,
+		.symbol = sym,
+		.slot = uint32_t(it - seen.begin())
+	});
+}
+
+MatchProgram MatchProgram::compile(const ETN_ref &etn)
+{
+	MatchProgram program;
+	std::vector <Symbol> seen;
+	_compile(etn, 0, seen, program);
+	program.slots = seen.size();
+	return program;
+}
+
+// Registers of a program, on the stack unless there are
+// more than patterns rarely need
+struct _registers {
+	ETN_ref fixed[16];
+	std::vector <ETN_ref> spilled;
+	ETN_ref *data = fixed;
+
+	_registers(size_t count) {
+		if (count > 16) {
+			spilled.resize(count);
+			data = spilled.data();
 		}
+	}
+
+	_registers(const _registers &) = delete;
+
+	ETN_ref &operator[](size_t i) {
+		return data[i];
+	}
+};
+
+// Bindings kept in a substitution
+template <typename C>
+struct _substitution_binder {
+	Substitution &sub;
+	C &copy;
+
+	void bind(const MatchProgram::instruction &ins, ETN_ref etn) {
+		sub.bind(ins.symbol, copy(etn));
+	}
+
+	// The substitution is cleared before a run, and symbols
+	// are bound in order of their slots
+	ETN_ref find(const MatchProgram::instruction &ins) const {
+		return sub[ins.slot].etn;
+	}
+};
+
+// Bindings kept in registers, by slot
+struct _slot_binder {
+	ETN_ref *slots;
+
+	void bind(const MatchProgram::instruction &ins, ETN_ref etn) {
+		slots[ins.slot] = etn;
+	}
+
+	ETN_ref find(const MatchProgram::instruction &ins) const {
+		return slots[ins.slot];
+	}
+};
+
+template <typename B>
+static bool _execute(const MatchProgram::instruction &ins, _registers &regs, B &binder)
+{
+	ETN_ref etn = regs[ins.reg];
+
+	switch (ins.code) {
+	case MatchProgram::check:
+		if (!etn->is <_expr_tree_op> ())
+			return false;
+
+		if (etn->as <_expr_tree_op> ().op != ins.op)
+			return false;
+
+		if (etn->meta.size < ins.size || etn->meta.depth < ins.depth)
+			return false;
+
+		regs[ins.reg + 1] = etn->as <_expr_tree_op> ().down;
+		return true;
+	case MatchProgram::next:
+		regs[ins.reg] = etn->next();
+		return regs[ins.reg];
+	case MatchProgram::bind:
+		binder.bind(ins, etn);
+		return true;
+	case MatchProgram::compare:
+		return equal(binder.find(ins), etn);
+	case MatchProgram::constant:
+		return etn->is <_expr_tree_atom> ()
+			&& equal(etn->as <_expr_tree_atom> ().atom, ins.etn->as <_expr_tree_atom> ().atom);
+	}
+
+	return false;
+}
+
+template <typename B>
+bool MatchProgram::_run(const ETN_ref &victim, B &&binder) const
+{
+	_registers regs(registers);
+	regs[0] = victim;
+
+	for (const instruction &ins : code) {
+		if (!_execute(ins, regs, binder))
+			return false;
+	}
+
+	return true;
+}
+
+bool MatchProgram::run(const ETN_ref &victim, Substitution &sub, scoped_memory_manager &smm) const
+{
+	auto copy = [&](const ETN_ref &ref) { return clone(ref, smm); };
+
+	sub.clear();
+	node_arena::mark nodes = smm.arena.checkpoint();
+	if (!_run(victim, _substitution_binder { sub, copy })) {
+		sub.clear();
+		smm.arena.rollback(nodes);
+		return false;
+	}
 
-		ETN_ref nhead = list.front();
-		list.pop();
+	return true;
+}
 
-		ETN_ref p = nhead;
-		while (list.size()) {
-			ETN_ref q = list.front();
-			list.pop();
+bool MatchProgram::run(const ETN_ref &victim, Substitution &sub) const
+{
+	auto borrow = [](const ETN_ref &ref) { return ref; };
+
+	sub.clear();
+	if (!_run(victim, _substitution_binder { sub, borrow })) {
+		sub.clear();
+		return false;
+	}
+
+	return true;
+}
+
+template <typename M, typename C>
+static ETN_ref _apply(Substitution &sub, const ETN_ref &etn, M &&make, C &&copy)
+{
+	if (etn->is <_expr_tree_op> ()) {
+		auto tree = etn->as <_expr_tree_op> ();
+
+		ETN_ref netn = make(tree);
+
+		ETN_ref head = tree.down;
+		ETN_ref nhead = nullptr;
+		ETN_ref p = nullptr;
+
+		while (head) {
+			ETN_ref q = _apply(sub, head, make, copy);
+			if (p)
+				p->next() = q;
+			else
+				nhead = q;
 
-			p->next() = q;
 			p = q;
+			head = head->next();
 		}
 
 		netn->as <_expr_tree_op> ().down = nhead;
+		netn->refresh();
 
 		return netn;
 	} else {
@@ -208,20 +951,100 @@ ETN_ref Substitution::apply(const ETN_ref &etn)
 		// since nodes are not necessarily in the same order
 		auto atom = etn->as <_expr_tree_atom> ().atom;
 		if (atom.is <Symbol> ()) {
-			Symbol sym = atom.as <Symbol> ();
-			if (contains(sym)) {
-				ETN_ref setn = clone(this->operator[](sym).etn);
+			if (ETN_ref bound = sub.find(atom.as <Symbol> ())) {
+				ETN_ref setn = copy(bound);
 				setn->next() = nullptr;
 				return setn;
 			}
 		}
 
-		ETN_ref setn = clone(etn);
+		ETN_ref setn = copy(etn);
 		setn->next() = nullptr;
 		return setn;
 	}
 }
 
+ETN_ref Substitution::apply(const ETN_ref &etn)
+{
+	auto make = [](const _expr_tree_op &tree) { return new ETN(tree); };
+	auto copy = [](const ETN_ref &ref) { return clone(ref); };
+	return _apply(*this, etn, make, copy);
+}
+
+ETN_ref Substitution::apply(const ETN_ref &etn, scoped_memory_manager &smm)
+{
+	auto make = [&](const _expr_tree_op &tree) { return smm.make(tree); };
+	auto copy = [&](const ETN_ref &ref) { return clone(ref, smm); };
+	return _apply(*this, etn, make, copy);
+}
+
+// Persistent application; nodes are treated as immutable, so
+// any subtree that is unchanged (in content and next sibling)
+// is shared, and only the paths to substituted symbols are new
+static ETN_ref _relink(const ETN_ref &ref, ETN_ref next, scoped_memory_manager &smm)
+{
+	if (ref->next() == next)
+		return ref;
+
+	ETN_ref netn = clone_soft(ref, smm);
+	netn->next() = next;
+	return netn;
+}
+
+static ETN_ref _apply_shared(Substitution &, const ETN_ref &, ETN_ref, scoped_memory_manager &);
+
+// Operands are rebuilt from last to first,
+// so that each one knows its next sibling
+static ETN_ref _apply_shared_operands(Substitution &sub, const ETN_ref &head, scoped_memory_manager &smm)
+{
+	if (!head)
+		return nullptr;
+
+	ETN_ref next = _apply_shared_operands(sub, head->next(), smm);
+	return _apply_shared(sub, head, next, smm);
+}
+
+static ETN_ref _apply_shared(Substitution &sub, const ETN_ref &etn, ETN_ref next, scoped_memory_manager &smm)
+{
+	if (etn->is <_expr_tree_atom> ()) {
+		auto &atom = etn->as <_expr_tree_atom> ().atom;
+		if (atom.is <Symbol> ()) {
+			if (ETN_ref bound = sub.find(atom.as <Symbol> ()))
+				return _relink(bound, next, smm);
+		}
+
+		return _relink(etn, next, smm);
+	}
+
+	auto &tree = etn->as <_expr_tree_op> ();
+
+	ETN_ref down = _apply_shared_operands(sub, tree.down, smm);
+
+	if (down == tree.down)
+		return _relink(etn, next, smm);
+
+	return smm.make(_expr_tree_op {
+		.op = tree.op,
+		.dom = tree.dom,
+		.down = down,
+		.next = next
+	});
+}
+
+ETN_ref Substitution::apply_shared(const ETN_ref &etn, scoped_memory_manager &smm)
+{
+	return _apply_shared(*this, etn, nullptr, smm);
+}
+
+Expression Substitution::apply_shared(const Expression &expr, scoped_memory_manager &smm)
+{
+	ETN_ref setn = apply_shared(expr.etn, smm);
+	return Expression {
+		.etn = setn,
+		.signature = default_signature(*setn)
+	};
+}
+
 Expression Substitution::apply(const Expression &expr)
 {
 	ETN_ref setn = apply(expr.etn);
@@ -230,3 +1053,155 @@ Expression Substitution::apply(const Expression &expr)
 		.signature = default_signature(*setn)
 	};
 }
+
+Expression Substitution::apply(const Expression &expr, scoped_memory_manager &smm)
+{
+	ETN_ref setn = apply(expr.etn, smm);
+	return Expression {
+		.etn = setn,
+		.signature = default_signature(*setn)
+	};
+}
+
+// Compiled rewriting
+static void _compile_build(const ETN_ref &etn, const std::vector <Symbol> &symbols, uint64_t mask, size_t depth, RewriteProgram &program)
+{
+	program.stack = std::max(program.stack, depth + 1);
+
+	// Subtrees without symbols of the pattern are shared as they are
+	if (!(etn->meta.symbols & mask)) {
+		program.build.push_back({ .code = RewriteProgram::share, .etn = etn });
+		return;
+	}
+
+	if (etn->is <_expr_tree_atom> ()) {
+		Symbol sym = etn->as <_expr_tree_atom> ().atom.as <Symbol> ();
+
+		auto it = std::find(symbols.begin(), symbols.end(), sym);
+		if (it == symbols.end()) {
+			program.build.push_back({ .code = RewriteProgram::share, .etn = etn });
+			return;
+		}
+
+		program.build.push_back({
+			.code = RewriteProgram::bound,
+			.slot = uint32_t(it - symbols.begin())
+		});
+
+		return;
+	}
+
+	uint32_t arity = 0;
+	etn->forall_operands([&](const ETN_ref &head) {
+		_compile_build(head, symbols, mask, depth + arity, program);
+		arity++;
+	});
+
+	const auto &tree = etn->as <_expr_tree_op> ();
+	program.build.push_back({
+		.code = RewriteProgram::make,
+		.op = tree.op,
+		.dom = tree.dom,
+		.arity = arity
+	});
+}
+
+RewriteProgram RewriteProgram::compile(const ETN_ref &from, const ETN_ref &to)
+{
+	RewriteProgram program;
+	program.pattern = MatchProgram::compile(from);
+
+	// Symbols of the pattern, by slot
+	std::vector <Symbol> symbols(program.pattern.slots);
+
+	uint64_t mask = 0;
+	for (const auto &ins : program.pattern.code) {
+		if (ins.code == MatchProgram::bind) {
+			symbols[ins.slot] = ins.symbol;
+			mask |= _expr_tree_meta::symbol_bit(ins.symbol);
+		}
+	}
+
+	_compile_build(to, symbols, mask, 0, program);
+
+	for (const Symbol &sym : to->symbols()) {
+		if (std::find(symbols.begin(), symbols.end(), sym) == symbols.end())
+			program.closed = false;
+	}
+
+	return program;
+}
+
+RewriteProgram RewriteProgram::compile(const Expression &from, const Expression &to)
+{
+	return compile(from.etn, to.etn);
+}
+
+ETN_ref RewriteProgram::apply(const ETN_ref &victim, scoped_memory_manager &smm) const
+{
+	_registers slots(pattern.slots);
+	if (!pattern._run(victim, _slot_binder { slots.data }))
+		return nullptr;
+
+	return _build(slots.data, smm);
+}
+
+ETN_ref RewriteProgram::instantiate(const Substitution &sub, scoped_memory_manager &smm) const
+{
+	if (sub.size() != pattern.slots)
+		return nullptr;
+
+	_registers slots(pattern.slots);
+	for (size_t i = 0; i < sub.size(); i++)
+		slots[i] = sub[i].etn;
+
+	return _build(slots.data, smm);
+}
+
+ETN_ref RewriteProgram::_build(ETN_ref *slots, scoped_memory_manager &smm) const
+{
+	_registers stack(this->stack);
+
+	size_t top = 0;
+	for (const instruction &ins : build) {
+		switch (ins.code) {
+		case share:
+			stack[top++] = ins.etn;
+			break;
+		case bound:
+			stack[top++] = slots[ins.slot];
+			break;
+		case make:
+		{
+			// Operands are relinked from last to first
+			ETN_ref down = nullptr;
+			for (size_t i = top; i-- > top - ins.arity; )
+				down = _relink(stack[i], down, smm);
+
+			top -= ins.arity;
+			stack[top++] = smm.make(_expr_tree_op {
+				.op = ins.op,
+				.dom = ins.dom,
+				.down = down,
+				.next = nullptr
+			});
+
+			break;
+		}
+		}
+	}
+
+	return _relink(stack[0], nullptr, smm);
+}
+
+std::optional <Expression> RewriteProgram::apply(const Expression &victim, scoped_memory_manager &smm) const
+{
+	ETN_ref etn = apply(victim.etn, smm);
+	if (!etn)
+		return std::nullopt;
+
+	return Expression {
+		.etn = etn,
+		.signature = closed ? victim.signature : default_signature(*etn)
+	};
+}
@@ -3,44 +3,179 @@
 #include "include/match.hpp"
 #include "include/format.hpp"
 
+// Node arena
+struct node_arena::slab {
+	static constexpr size_t capacity = 256;
+
+	slab *next;
+	size_t used;
+
+	alignas(ETN) unsigned char storage[capacity * sizeof(ETN)];
+
+	ETN_ref at(size_t i) {
+		return reinterpret_cast <ETN_ref> (storage) + i;
+	}
+};
+
+node_arena::~node_arena()
+{
+	release();
+}
+
+void *node_arena::allocate()
+{
+	if (!head || head->used == slab::capacity) {
+		slab *s = new slab;
+		s->next = head;
+		s->used = 0;
+		head = s;
+	}
+
+	count++;
+	return head->at(head->used++);
+}
+
+node_arena::mark node_arena::checkpoint() const
+{
+	return mark { head, head ? head->used : 0 };
+}
+
+void node_arena::rollback(const mark &m)
+{
+	while (head != m.head) {
+		slab *s = head;
+		head = head->next;
+
+		if constexpr (!std::is_trivially_destructible_v <ETN>) {
+			for (size_t i = 0; i < s->used; i++)
+				s->at(i)->~ETN();
+		}
+
+		count -= s->used;
+		delete s;
+	}
+
+	if (!head)
+		return;
+
+	if constexpr (!std::is_trivially_destructible_v <ETN>) {
+		for (size_t i = m.used; i < head->used; i++)
+			head->at(i)->~ETN();
+	}
+
+	count -= head->used - m.used;
+	head->used = m.used;
+}
+
+void node_arena::splice(node_arena &other)
+{
+	if (!other.head)
+		return;
+
+	// Keep the partially filled slab at the front
+	slab *tail = other.head;
+	while (tail->next)
+		tail = tail->next;
+
+	if (head) {
+		tail->next = head->next;
+		head->next = other.head;
+	} else {
+		head = other.head;
+	}
+
+	count += other.count;
+
+	other.head = nullptr;
+	other.count = 0;
+}
+
+void node_arena::release()
+{
+	while (head) {
+		slab *s = head;
+		head = head->next;
+
+		// Nodes are trivially destructible (symbols
+		// are interned), so this is a no-op
+		if constexpr (!std::is_trivially_destructible_v <ETN>) {
+			for (size_t i = 0; i < s->used; i++)
+				s->at(i)->~ETN();
+		}
+
+		delete s;
+	}
+
+	count = 0;
+}
+
 // Scoped memory management
 scoped_memory_manager::~scoped_memory_manager()
 {
 	clear();
 }
 
+ETN_ref scoped_memory_manager::make(const _expr_tree_atom &atom)
+{
+	return new (arena.allocate()) ETN(atom);
+}
+
+ETN_ref scoped_memory_manager::make(const _expr_tree_op &op)
+{
+	return new (arena.allocate()) ETN(op);
+}
+
 void scoped_memory_manager::transfer_to(scoped_memory_manager &smm)
 {
 	while (deferred.size()) {
-		smm.deferred.push(deferred.front());
+		ETN_ref etn = deferred.front();
 		deferred.pop();
-	}
-}
 
-void scoped_memory_manager::drop(ETN_ref etn)
-{
-	// TODO: enable only on debug mode
-	auto copy = deferred;
-	while (copy.size()) {
-		if (copy.front() == etn) {
+#if OXIDIUS_MEMORY_CHECKS
+		if (!smm.owned.insert(etn).second) {
 			fmt::println("double free detected on address {}", (void *) etn);
 			abort();
 		}
+#endif
 
-		copy.pop();
+		smm.deferred.push(etn);
 	}
 
-	if (etn->is <_expr_tree_op> ()) {
-		auto tree = etn->as <_expr_tree_op> ();
+#if OXIDIUS_MEMORY_CHECKS
+	owned.clear();
+#endif
 
-		ETN_ref head = tree.down;
-		while (head) {
-			drop(head);
-			head = head->next();
+	smm.dropped += dropped;
+	dropped = 0;
+
+	smm.arena.splice(arena);
+}
+
+void scoped_memory_manager::drop(ETN_ref etn)
+{
+	std::vector <ETN_ref> stack { etn };
+	while (stack.size()) {
+		ETN_ref ref = stack.back();
+		stack.pop_back();
+
+#if OXIDIUS_MEMORY_CHECKS
+		if (!owned.insert(ref).second) {
+			fmt::println("double free detected on address {}", (void *) ref);
+			abort();
+		}
+#endif
+
+		if (ref->is <_expr_tree_op> ()) {
+			ETN_ref head = ref->as <_expr_tree_op> ().down;
+			while (head) {
+				stack.push_back(head);
+				head = head->next();
+			}
 		}
-	}
 
-	deferred.push(etn);
+		deferred.push(ref);
+		dropped++;
+	}
 }
 
 void scoped_memory_manager::drop(const Expression &expr)
@@ -56,8 +191,8 @@ void scoped_memory_manager::drop(const Statement &statement)
 
 void scoped_memory_manager::drop(const Substitution &sub)
 {
-	for (auto &[sym, expr] : sub)
-		drop(expr.etn);
+	for (auto &[sym, etn] : sub)
+		drop(etn);
 }
 
 void scoped_memory_manager::drop(const UnresolvedValue &rv)
@@ -81,12 +216,28 @@ void scoped_memory_manager::drop(const UnresolvedValue &rv)
 
 void scoped_memory_manager::clear()
 {
+	released += deferred.size() + arena.count;
+
 	while (deferred.size()) {
 		ETN_ref ref = deferred.front();
 		deferred.pop();
 
 		delete ref;
 	}
+
+#if OXIDIUS_MEMORY_CHECKS
+	owned.clear();
+#endif
+
+	arena.release();
+}
+
+void list_scope(const scoped_memory_manager &smm)
+{
+	fmt::println("scope:");
+	fmt::println("  dropped: {}", smm.dropped);
+	fmt::println("  pending: {} (+{} in arena)", smm.deferred.size(), smm.arena.count);
+	fmt::println("  released: {}", smm.released);
 }
 
 // Drop methods
@@ -110,45 +261,68 @@ Substitution &Substitution::drop(scoped_memory_manager &smm)
 }
 
 // Cloning
-ETN_ref clone(const ETN_ref &ref)
+template <typename A>
+static ETN_ref _clone(const ETN_ref &ref, A &&alloc)
 {
 	if (ref->is <_expr_tree_op> ()) {
 		auto tree = ref->as <_expr_tree_op> ();
 
-		ETN_ref netn = new ETN(tree);
+		ETN_ref netn = alloc(tree);
 
 		ETN_ref head = tree.down;
+		ETN_ref nhead = nullptr;
+		ETN_ref p = nullptr;
 
-		std::queue <ETN_ref> list;
 		while (head) {
-			list.push(clone(head));
-			head = head->next();
-		}
-
-		ETN_ref nhead = list.front();
-		list.pop();
+			ETN_ref q = _clone(head, alloc);
+			if (p)
+				p->next() = q;
+			else
+				nhead = q;
 
-		ETN_ref p = nhead;
-		while (list.size()) {
-			ETN_ref q = list.front();
-			list.pop();
-
-			p->next() = q;
 			p = q;
+			head = head->next();
 		}
 
+		// Operands are structurally the same, so
+		// the metadata of netn is still valid
 		netn->as <_expr_tree_op> ().down = nhead;
 
 		return netn;
 	} else {
-		return new ETN(ref->as <_expr_tree_atom> ());
+		return alloc(ref->as <_expr_tree_atom> ());
 	}
 }
 
-ETN_ref clone_soft(const ETN_ref &ref)
+template <typename A>
+static ETN_ref _clone_soft(const ETN_ref &ref, A &&alloc)
 {
 	if (ref->is <_expr_tree_op> ())
-		return new ETN(ref->as <_expr_tree_op> ());
+		return alloc(ref->as <_expr_tree_op> ());
+
+	return alloc(ref->as <_expr_tree_atom> ());
+}
+
+static auto _heap_allocator = [](const auto &node) -> ETN_ref {
+	return new ETN(node);
+};
 
-	return new ETN(ref->as <_expr_tree_atom> ());
+ETN_ref clone(const ETN_ref &ref)
+{
+	return _clone(ref, _heap_allocator);
+}
+
+ETN_ref clone_soft(const ETN_ref &ref)
+{
+	return _clone_soft(ref, _heap_allocator);
+}
+
+ETN_ref clone(const ETN_ref &ref, scoped_memory_manager &smm)
+{
+	return _clone(ref, [&](const auto &node) { return smm.make(node); });
+}
+
+ETN_ref clone_soft(const ETN_ref &ref, scoped_memory_manager &smm)
+{
+	return _clone_soft(ref, [&](const auto &node) { return smm.make(node); });
 }
@@ -192,8 +192,8 @@ std::optional <std::pair <Signature, int>> signature_from_tokens(const std::vect
 			return fail_state;
 		}
 
-		std::string str = symbol->as <Symbol> ();
-		std::string dstr = domain->as <Symbol> ();
+		Symbol sym = symbol->as <Symbol> ();
+		const std::string &dstr = domain->as <Symbol> ().str();
 
 		Domain dom;
 		if (dstr == "R") {
@@ -205,7 +205,7 @@ std::optional <std::pair <Signature, int>> signature_from_tokens(const std::vect
 			return fail_state;
 		}
 
-		if (!add_signature(result, str, dom))
+		if (!add_signature(result, sym, dom))
 			return fail_state;
 
 		auto comma = safe_get(false);
@@ -365,8 +365,8 @@ std::optional <Statement> Statement::from(const std::string &s)
 	}
 
 	// TODO: safe join
-	auto sl = default_signature(sig, *lhs);
-	auto sr = default_signature(sig, *rhs);
+	Signature_ref sl = default_signature(sig, *lhs);
+	Signature_ref sr = default_signature(sig, *rhs);
 
 	return Statement {
 		.lhs = Expression { lhs, sl },
@@ -425,8 +425,8 @@ auto_optional <Symbolic> TokenStreamParser::parse_symbolic_scope()
 		return std::nullopt;
 	}
 
-	auto sl = default_signature(sig, *lhs);
-	auto sr = default_signature(sig, *rhs);
+	Signature_ref sl = default_signature(sig, *lhs);
+	Signature_ref sr = default_signature(sig, *rhs);
 
 	return Statement {
 		.lhs = Expression { lhs, sl },
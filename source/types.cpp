@@ -0,0 +1,55 @@
+#include <unordered_map>
+#include <vector>
+
+#include "include/types.hpp"
+
+// Symbol interning; the table is local to a function so
+// that symbols may be used during static initialization
+struct _symbol_table {
+	std::vector <std::string> names;
+	std::unordered_map <std::string, uint32_t> ids;
+
+	_symbol_table() {
+		intern("");
+	}
+
+	uint32_t intern(const std::string &name) {
+		auto it = ids.find(name);
+		if (it != ids.end())
+			return it->second;
+
+		uint32_t id = names.size();
+		names.push_back(name);
+		ids.emplace(name, id);
+		return id;
+	}
+};
+
+static _symbol_table &symbol_table()
+{
+	static _symbol_table table;
+	return table;
+}
+
+Symbol::Symbol() : id(0) {}
+
+Symbol::Symbol(const char *name) : id(symbol_table().intern(name)) {}
+
+Symbol::Symbol(const std::string &name) : id(symbol_table().intern(name)) {}
+
+const std::string &Symbol::str() const
+{
+	return symbol_table().names[id];
+}
+
+Symbol Symbol::from(uint32_t id)
+{
+	Symbol sym;
+	sym.id = id;
+	return sym;
+}
+
+size_t Symbol::count()
+{
+	return symbol_table().names.size();
+}